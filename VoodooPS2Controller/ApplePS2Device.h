@@ -27,6 +27,7 @@
 #include <kern/queue.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOLib.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <architecture/i386/pio.h>
 
 #ifdef DEBUG_MSG
@@ -534,6 +535,9 @@ enum
     kPS2M_swipe4Up,
     kPS2M_swipe4Left,
     kPS2M_swipe4Right,
+    kPS2M_swipeBegin,           // continuous swipe started (data is PS2SwipeInfo*)
+    kPS2M_swipeUpdate,          // continuous swipe moved (data is PS2SwipeInfo*)
+    kPS2M_swipeEnd,             // continuous swipe lifted (data is PS2SwipeInfo*)
 };
 
 typedef struct PS2KeyInfo
@@ -544,6 +548,15 @@ typedef struct PS2KeyInfo
     bool    eatKey;
 } PS2KeyInfo;
 
+typedef struct PS2SwipeInfo
+{
+    int64_t time;
+    int     fingers;            // 3 or 4
+    int     dx, dy;             // displacement since begin (+x right, +y up)
+    int     vx, vy;             // velocity in units per second
+    int     committed;          // kPS2M_swipe* already sent for this swipe, or -1
+} PS2SwipeInfo;
+
 
 //
 // Enumeration of 'whatToDo' values passed to power control action.
@@ -566,6 +579,62 @@ typedef enum
 #endif
 } PS2DeviceType;
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Clock: time and timers as seen by the keyboard and trackpad drivers
+//
+// The drivers read the time and arm their timers through a clock pointer
+// of their own, instead of calling clock_get_uptime or the
+// IOTimerEventSource timeout calls directly.  It points at their
+// PS2KernelClock unless they replace it, as the ALPS driver does with a
+// PS2ReplayClock while it replays recorded packets.
+//
+// All times are in absolute time units, as from clock_get_uptime.
+//
+
+class PS2Clock
+{
+public:
+    virtual uint64_t uptime() = 0;
+    virtual uint64_t toNanoseconds(uint64_t abs) = 0;
+    virtual uint64_t fromNanoseconds(uint64_t ns) = 0;
+    virtual void setTimeout(IOTimerEventSource* timer, uint64_t interval) = 0;
+    virtual void setDeadline(IOTimerEventSource* timer, uint64_t deadline) = 0;
+    virtual void cancelTimeout(IOTimerEventSource* timer) = 0;
+};
+
+class PS2KernelClock : public PS2Clock
+{
+public:
+    virtual uint64_t uptime()
+        { uint64_t now; clock_get_uptime(&now); return now; }
+    virtual uint64_t toNanoseconds(uint64_t abs)
+        { uint64_t ns; absolutetime_to_nanoseconds(abs, &ns); return ns; }
+    virtual uint64_t fromNanoseconds(uint64_t ns)
+        { uint64_t abs; nanoseconds_to_absolutetime(ns, &abs); return abs; }
+    virtual void setTimeout(IOTimerEventSource* timer, uint64_t interval)
+        { timer->setTimeout(*(AbsoluteTime*)&interval); }
+    virtual void setDeadline(IOTimerEventSource* timer, uint64_t deadline)
+        { timer->wakeAtTime(*(AbsoluteTime*)&deadline); }
+    virtual void cancelTimeout(IOTimerEventSource* timer)
+        { timer->cancelTimeout(); }
+};
+
+// Time that only moves when advanced, so recorded input can be replayed at
+// its own packet rate however fast it is fed in.  Deadlines are armed on
+// the kernel clock, relative to the replayed time.
+class PS2ReplayClock : public PS2KernelClock
+{
+    uint64_t _now;
+public:
+    PS2ReplayClock(uint64_t start) : _now(start) {}
+    void advance(uint64_t ns)
+        { _now += fromNanoseconds(ns); }
+    virtual uint64_t uptime()
+        { return _now; }
+    virtual void setDeadline(IOTimerEventSource* timer, uint64_t deadline)
+        { setTimeout(timer, deadline > _now ? deadline - _now : 0); }
+};
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2Device Class Declaration
 //
@@ -229,6 +229,7 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
     
     // initialize state
     _device                    = 0;
+    _clock                     = &_kernelClock;
     _extendCount               = 0;
     _interruptHandlerInstalled = false;
     _ledState                  = 0;
@@ -1130,7 +1131,7 @@ IOReturn ApplePS2Keyboard::message(UInt32 type, IOService* provider, void* argum
             if (1 == packet[0] || 2 == packet[0])
             {
                 // mark packet with timestamp
-                clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+                *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
                 if (!_macroInversion || !invertMacros(packet))
                 {
                     // normal packet
@@ -1141,13 +1142,13 @@ IOReturn ApplePS2Keyboard::message(UInt32 type, IOService* provider, void* argum
             {
                 // code 3 and 4 indicate send both make and break
                 packet[0] -= 2;
-                clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+                *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
                 if (!_macroInversion || !invertMacros(packet))
                 {
                     // normal packet (make)
                     dispatchKeyboardEventWithPacket(packet);
                 }
-                clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+                *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
                 packet[1] |= 0x80; // break code
                 if (!_macroInversion || !invertMacros(packet))
                 {
@@ -1186,7 +1187,7 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
         packet[0] = 0x00;
         packet[1] = kSC_Reset;
         // mark packet with timestamp
-        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+        *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
         _ringBuffer.advanceHead(kPacketLength);
         _extendCount = 0;
         return kPS2IR_packetReady;
@@ -1269,7 +1270,7 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
         packet[0] = extended + 1;  // packet[0] = 0 is special packet, so add one
         packet[1] = data;
         // mark packet with timestamp
-        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+        *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
         _ringBuffer.advanceHead(kPacketLength);
         return kPS2IR_packetReady;
     }
@@ -1325,9 +1326,9 @@ bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
     {
         // cancel macro conversion if packet arrives too late
         uint64_t now_ns;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&packet[kPacketTimeOffset]), &now_ns);
+        now_ns = getClock()->toNanoseconds(*(uint64_t*)(&packet[kPacketTimeOffset]));
         uint64_t prev;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]), &prev);
+        prev = getClock()->toNanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]));
         if (now_ns-prev > _macroMaxTime)
             dispatchInvertBuffer();
 #if 0 // for testing min/max between macro segments
@@ -1403,10 +1404,10 @@ void ApplePS2Keyboard::onMacroTimer()
     if (_macroCurrent > 0)
     {
         uint64_t now_abs, now_ns;
-        clock_get_uptime(&now_abs);
-        absolutetime_to_nanoseconds(now_abs, &now_ns);
+        now_abs = getClock()->uptime();
+        now_ns = getClock()->toNanoseconds(now_abs);
         uint64_t prev;
-        absolutetime_to_nanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]), &prev);
+        prev = getClock()->toNanoseconds(*(uint64_t*)(&_macroBuffer[(_macroCurrent-1)*kPacketLength+kPacketTimeOffset]));
         if (now_ns-prev > _macroMaxTime)
             dispatchInvertBuffer();
     }
@@ -1558,7 +1559,7 @@ void ApplePS2Keyboard::onSleepEjectTimer()
         case kTimerEject:
         {
             uint64_t now_abs;
-            clock_get_uptime(&now_abs);
+            now_abs = getClock()->uptime();
             dispatchKeyboardEventX(0x92, true, now_abs);
             break;
         }
@@ -1584,7 +1585,7 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     unsigned keyCode;
     uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
     uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    now_ns = getClock()->toNanoseconds(now_abs);
     
     //
     // Convert the scan code into a key code index.
@@ -1601,9 +1602,9 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
         // Make key-down and key-up event ADB event
         if (scanCode == 0xf2 || scanCode == 0xf1)
         {
-            clock_get_uptime(&now_abs);
+            now_abs = getClock()->uptime();
             dispatchKeyboardEventX(_PS2ToADBMap[scanCode], true, now_abs);
-            clock_get_uptime(&now_abs);
+            now_abs = getClock()->uptime();
             dispatchKeyboardEventX(_PS2ToADBMap[scanCode], false, now_abs);
             return true;
         }
@@ -1859,15 +1860,15 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
         if (goingDown)
         {
             static bool firsttime = true;
-            clock_get_uptime(&now_abs);
+            now_abs = getClock()->uptime();
             dispatchKeyboardEventX(adbKeyCode, true, now_abs);
-            clock_get_uptime(&now_abs);
+            now_abs = getClock()->uptime();
             dispatchKeyboardEventX(adbKeyCode, false, now_abs);
             if (!firsttime)
             {
-                clock_get_uptime(&now_abs);
+                now_abs = getClock()->uptime();
                 dispatchKeyboardEventX(adbKeyCode, true, now_abs);
-                clock_get_uptime(&now_abs);
+                now_abs = getClock()->uptime();
                 dispatchKeyboardEventX(adbKeyCode, false, now_abs);
             }
             firsttime = false;
@@ -1905,7 +1906,7 @@ void ApplePS2Keyboard::sendKeySequence(UInt16* pKeys)
     for (; *pKeys; ++pKeys)
     {
         uint64_t now_abs;
-        clock_get_uptime(&now_abs);
+        now_abs = getClock()->uptime();
         dispatchKeyboardEventX(*pKeys & 0xFF, *pKeys & 0x1000 ? false : true, now_abs);
     }
 }
@@ -1957,6 +1958,13 @@ void ApplePS2Keyboard::receiveMessage(int message, void* data)
             DEBUG_LOG("ApplePS2Keyboard: Synaptic Trackpad call Swipe 4 Up\n");
             sendKeySequence(_actionSwipe4Up);
             break;
+            
+        case kPS2M_swipeBegin:
+        case kPS2M_swipeUpdate:
+        case kPS2M_swipeEnd:
+            // continuous progress is for listeners that can animate;
+            // the key sequence is sent when the swipe commits
+            break;
     }
 }
 
@@ -73,6 +73,8 @@ class EXPORT ApplePS2Keyboard : public IOHIKeyboard
 
 private:
     ApplePS2KeyboardDevice *    _device;
+    PS2Clock *                  _clock;
+    PS2KernelClock              _kernelClock;
     UInt32                      _keyBitVector[KBV_NUNITS];
     UInt8                       _extendCount;
     RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
@@ -164,10 +166,12 @@ protected:
     virtual UInt32 maxKeyCodes();
     inline void dispatchKeyboardEventX(unsigned int keyCode, bool goingDown, uint64_t time)
         { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); }
+    inline PS2Clock* getClock()
+        { return _clock; }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
-        { timer->setTimeout(*(AbsoluteTime*)&time); }
+        { getClock()->setTimeout(timer, time); }
     inline void cancelTimer(IOTimerEventSource* timer)
-        { timer->cancelTimeout(); }
+        { getClock()->cancelTimeout(timer); }
 
 public:
     virtual bool init(OSDictionary * dict);
@@ -75,6 +75,14 @@ public:
             return 0;
         return m_sum / m_count;
     }
+    T at(int i)
+    {
+        // i-th oldest entry, undefined unless i < count()
+        if (m_count < N)
+            return m_buffer[i];
+        i += m_index;
+        return m_buffer[i >= N ? i - N : i];
+    }
 };
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -131,5 +139,57 @@ public:
     }
 };
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// AdaptiveAverage Class Declaration
+//
+// One-Euro style filter in fixed point: an exponential average whose
+// weight for the new sample (alpha, in 1/256) grows with the smoothed
+// per-sample speed. A resting finger gets minalpha, which averages out
+// jitter; a moving finger gets up to the full sample, so there is little
+// lag. beta is the alpha added per unit of speed. The filtered value is
+// kept in 1/256 units so slow motion is not lost to rounding.
+//
+
+template <class T, class TT>
+class AdaptiveAverage
+{
+private:
+    TT m_last;
+    TT m_speed;
+    bool m_lastvalid;
+    int m_minalpha;
+    int m_beta;
+    
+public:
+    inline AdaptiveAverage() { setParams(32, 16); reset(); }
+    inline void setParams(int minalpha, int beta)
+    {
+        m_minalpha = minalpha < 1 ? 1 : minalpha > 256 ? 256 : minalpha;
+        m_beta = beta < 0 ? 0 : beta;
+    }
+    T filter(T data)
+    {
+        TT value = (TT)data << 8;
+        if (!m_lastvalid)
+        {
+            m_last = value;
+            m_speed = 0;
+            m_lastvalid = true;
+            return data;
+        }
+        TT delta = value - m_last;
+        // speed is low passed (1/2 each) so a single noisy sample can't open the filter
+        m_speed = (m_speed + (delta < 0 ? -delta : delta)) >> 1;
+        TT alpha = m_minalpha + ((m_speed * m_beta) >> 8);
+        if (alpha > 256)
+            alpha = 256;
+        m_last += (delta * alpha) / 256;
+        return (T)((m_last + 128) >> 8);
+    }
+    inline void reset()
+    {
+        m_lastvalid = false;
+    }
+};
 
 #endif
@@ -58,6 +58,7 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     
     // initialize state...
     _device = NULL;
+    _clock = &_kernelClock;
     _interruptHandlerInstalled = false;
     _powerControlHandlerInstalled = false;
     _messageHandlerInstalled = false;
@@ -184,8 +185,11 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     
     inSwipeLeft=inSwipeRight=inSwipeDown=inSwipeUp=0;
     xmoved=ymoved=0;
+    lastcx = lastcy = 0;
+    lastcvalid = false;
     
     momentumscroll = true;
+    scrolldirx = scrolldiry = 0;
     scrollTimer = 0;
     momentumscrolltimer = 10000000;
     momentumscrollthreshy = 7;
@@ -199,6 +203,30 @@ bool VoodooPS2TouchPadBase::init(OSDictionary * dict)
     
 	touchmode=MODE_NOTOUCH;*/
     
+    // the configuration defaults above are disabled, the Platform Profile
+    // supplies them; what follows is state that must not start at zero
+    
+    // reciprocal packet intervals for acceleration and prediction
+    for (int i = 1; i < kAccelIntervals; i++)
+        accelrecip[i] = 65536 / i;
+    accelrecip[0] = 65536;
+    
+    // continuous swipe: no direction committed yet, flick off
+    swipecontinuous = false;
+    swipeflickvelocity = 0;
+    swipeflickdelta = 150;
+    swipecommitted = -1;
+    
+    // adaptive smoothing off, with usable gains if it is turned on
+    smoothfilterx = smoothfiltery = 0;
+    smoothminalpha = 32;
+    smoothbeta = 16;
+    
+    // finger change window: no early close unless FingerChangeStableDelta is set
+    ignorestabledelta = 0;
+    ignoredcount = 0;
+    ignoredpackets = ignoredpacketsshown = 0;
+    
 	IOLog("VoodooPS2TouchPad Base Driver loaded...\n");
     
 	setProperty("Revision", 24, 32);
@@ -420,6 +448,132 @@ void VoodooPS2TouchPadBase::stop( IOService * provider )
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void VoodooPS2TouchPadBase::coalesceRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now)
+{
+    //
+    // While a packet backlog is being drained, pointer motion with the same
+    // button state is summed into one event. A button change (tap, click)
+    // or a scroll event in between flushes what has been collected so far,
+    // so event order and button transitions are kept.
+    //
+    
+    if (coalescescroll || (coalescepointer && buttonState != coalescebuttons))
+        flushCoalescedEvents();
+    
+    if (!coalescepointer)
+    {
+        coalescepointer = true;
+        coalescebuttons = buttonState;
+        coalescedx = coalescedy = 0;
+    }
+    coalescedx += dx;
+    coalescedy += dy;
+    coalescetime = now;
+}
+
+void VoodooPS2TouchPadBase::coalesceScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
+{
+    if (coalescepointer)
+        flushCoalescedEvents();
+    
+    if (!coalescescroll)
+    {
+        coalescescroll = true;
+        coalescescroll1 = coalescescroll2 = coalescescroll3 = 0;
+    }
+    coalescescroll1 += deltaAxis1;
+    coalescescroll2 += deltaAxis2;
+    coalescescroll3 += deltaAxis3;
+    coalescetime = now;
+}
+
+static inline short clampShort(int value)
+{
+    return value > 32767 ? 32767 : value < -32768 ? -32768 : value;
+}
+
+void VoodooPS2TouchPadBase::flushCoalescedEvents()
+{
+    if (coalescepointer)
+    {
+        coalescepointer = false;
+        dispatchRelativePointerEvent(coalescedx, coalescedy, coalescebuttons, *(AbsoluteTime*)&coalescetime);
+    }
+    if (coalescescroll)
+    {
+        coalescescroll = false;
+        dispatchScrollWheelEvent(clampShort(coalescescroll1), clampShort(coalescescroll2),
+                                 clampShort(coalescescroll3), *(AbsoluteTime*)&coalescetime);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//
+// Whole units of a Q16 accumulator, rounded toward zero so positive and
+// negative motion lose the same; the fraction stays in the accumulator.
+//
+
+static inline int q16Take(int64_t *acc)
+{
+    int64_t q = *acc >= 0 ? *acc >> 16 : -((-*acc) >> 16);
+    *acc -= q * 65536;
+    return (int) q;
+}
+
+//
+// Momentum scroll. On release the scroll velocity is fitted by least squares
+// to the finger positions of the last few packets, stamped when they
+// arrived. The timer then runs at a fixed cadence (MomentumScrollTimer, in
+// ns, converted to absolute time for the deadlines), scaling the
+// release velocity by a precomputed decay table and dispatching whatever
+// whole units have accumulated. The fling ends when the velocity drops to
+// MomentumScrollThreshY units per tick, or when the table runs out.
+//
+
+void VoodooPS2TouchPadBase::startMomentumScroll(uint64_t now_abs)
+{
+    int count = time_history.count();
+    if (count < 2)
+        return;
+    
+    // sample times in ~us (2^10 ns) from the oldest, positions as seen
+    uint64_t t0 = time_history.at(0);
+    int64_t st = 0, sx = 0, sy = 0;
+    for (int i = 0; i < count; i++)
+    {
+        st += (int64_t) ((time_history.at(i) - t0) >> 10);
+        sx += x_history.at(i);
+        sy += y_history.at(i);
+    }
+    st /= count;
+    sx /= count;
+    sy /= count;
+    int64_t stt = 0, stx = 0, sty = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int64_t t = (int64_t) ((time_history.at(i) - t0) >> 10) - st;
+        stt += t * t;
+        stx += t * (x_history.at(i) - sx);
+        sty += t * (y_history.at(i) - sy);
+    }
+    if (!stt)
+        return;
+    
+    // slope in Q16 units per ~us, then per tick
+    int64_t tick = (int64_t) (momentumscrolltimer >> 10);
+    momentumscrollvx = (whdivisor && hscroll) ? (stx << 16) / stt * tick : 0;
+    momentumscrollvy = wvdivisor ? (sty << 16) / stt * tick : 0;
+    momentumscrollrestx = momentumscrollresty = 0;
+    momentumscrolltick = 0;
+    momentumscrollcurrent = 1;
+    momentumscrolldeadline = now_abs;
+    DEBUG_LOG("ps2: momentum start vx=%lld vy=%lld (Q16/tick) from %d samples\n", momentumscrollvx, momentumscrollvy, count);
+    
+    momentumscrolldeadline += getClock()->fromNanoseconds(momentumscrolltimer);
+    setTimerDeadline(scrollTimer, momentumscrolldeadline);
+}
+
 void VoodooPS2TouchPadBase::onScrollTimer(void)
 {
     //
@@ -431,29 +585,36 @@ void VoodooPS2TouchPadBase::onScrollTimer(void)
         return;
     
     uint64_t now_abs;
-	clock_get_uptime(&now_abs);
+	now_abs = getClock()->uptime();
     
-    int64_t dy64 = momentumscrollcurrent / (int64_t)momentumscrollinterval + momentumscrollrest2;
-    int dy = (int)dy64;
-    if (abs(dy) > momentumscrollthreshy)
-    {
-        // dispatch the scroll event
-        dispatchScrollWheelEventX(wvdivisor ? dy / wvdivisor : 0, 0, 0, now_abs);
-        momentumscrollrest2 = wvdivisor ? dy % wvdivisor : 0;
-    
-        // adjust momentumscrollcurrent
-        momentumscrollcurrent = momentumscrollcurrent * momentumscrollmultiplier + momentumscrollrest1;
-        momentumscrollrest1 = momentumscrollcurrent % momentumscrolldivisor;
-        momentumscrollcurrent /= momentumscrolldivisor;
-        
-        // start another timer
-        setTimerTimeout(scrollTimer, momentumscrolltimer);
-    }
-    else
+    int64_t decay = momentumscrolltick < kMomentumTicks ? momentumdecay[momentumscrolltick] : 0;
+    int64_t vx = (momentumscrollvx * decay) >> 16;
+    int64_t vy = (momentumscrollvy * decay) >> 16;
+    momentumscrolltick++;
+    
+    int64_t thresh = (int64_t) momentumscrollthreshy << 16;
+    if (vx <= thresh && vx >= -thresh && vy <= thresh && vy >= -thresh)
     {
         // no more scrolling...
+        DEBUG_LOG("ps2: momentum done after %d timer wakeups\n", momentumscrolltick);
         momentumscrollcurrent = 0;
+        return;
     }
+    
+    // dispatch the whole units accumulated so far
+    momentumscrollrestx += (vx * whdivinv) >> 16;
+    momentumscrollresty += (vy * wvdivinv) >> 16;
+    int dx = q16Take(&momentumscrollrestx);
+    int dy = q16Take(&momentumscrollresty);
+    if (dx || dy)
+        dispatchScrollWheelEventX(dy, -dx, 0, now_abs);
+    
+    // next tick on the fixed cadence, skipping any that were missed
+    uint64_t interval_abs = getClock()->fromNanoseconds(momentumscrolltimer);
+    momentumscrolldeadline += interval_abs;
+    if (momentumscrolldeadline <= now_abs)
+        momentumscrolldeadline = now_abs + interval_abs;
+    setTimerDeadline(scrollTimer, momentumscrolldeadline);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -461,7 +622,7 @@ void VoodooPS2TouchPadBase::onScrollTimer(void)
 void VoodooPS2TouchPadBase::onButtonTimer(void)
 {
 	uint64_t now_abs;
-	clock_get_uptime(&now_abs);
+	now_abs = getClock()->uptime();
     
     middleButton(lastbuttons, now_abs, fromTimer);
 }
@@ -474,7 +635,7 @@ UInt32 VoodooPS2TouchPadBase::middleButton(UInt32 buttons, uint64_t now_abs, MBC
     // cancel timer if we see input before timeout has fired, but after expired
     bool timeout = false;
     uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    now_ns = getClock()->toNanoseconds(now_abs);
     if (fromTimer == from || fromCancel == from || now_ns - _buttontime > _maxmiddleclicktime)
         timeout = true;
 
@@ -588,14 +749,623 @@ UInt32 VoodooPS2TouchPadBase::middleButton(UInt32 buttons, uint64_t now_abs, MBC
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+//
+// Mode changes of the gesture recognizer. The first entry matching the
+// current mode (or MODE_ANY) and the event wins; no match keeps the mode.
+// Side effects of a change (buttons, timers) stay in recognizeGesture.
+//
+
+const VoodooPS2TouchPadBase::GestureTransition VoodooPS2TouchPadBase::gestureTransitions[] =
+{
+    // finger lifted
+    { MODE_DRAG,            GESTURE_TAP,        MODE_NOTOUCH },
+    { MODE_DRAG,            GESTURE_CLICK,      MODE_NOTOUCH },
+    { MODE_DRAGLOCK,        GESTURE_TAP,        MODE_NOTOUCH },
+    { MODE_DRAGLOCK,        GESTURE_CLICK,      MODE_NOTOUCH },
+    { MODE_ANY,             GESTURE_TAP,        MODE_PREDRAG },
+    { MODE_ANY,             GESTURE_CLICK,      MODE_NOTOUCH },
+    { MODE_DRAG,            GESTURE_LIFT_HOLD,  MODE_DRAGNOTOUCH },
+    { MODE_DRAGLOCK,        GESTURE_LIFT_HOLD,  MODE_DRAGNOTOUCH },
+    { MODE_ANY,             GESTURE_LIFT_HOLD,  MODE_NOTOUCH },
+    { MODE_ANY,             GESTURE_LIFT,       MODE_NOTOUCH },
+    // finger down
+    { MODE_PREDRAG,         GESTURE_TOUCH,      MODE_DRAG },
+    { MODE_DRAGNOTOUCH,     GESTURE_TOUCH,      MODE_DRAGLOCK },
+    { MODE_ANY,             GESTURE_MULTI,      MODE_MTOUCH },
+    { MODE_NOTOUCH,         GESTURE_CONTACT,    MODE_MOVE },
+    { MODE_MTOUCH,          GESTURE_SINGLE,     MODE_MOVE },
+    // timers
+    { MODE_PREDRAG,         GESTURE_TIMEOUT,    MODE_NOTOUCH },
+    { MODE_DRAGNOTOUCH,     GESTURE_TIMEOUT,    MODE_NOTOUCH },
+};
+
+VoodooPS2TouchPadBase::TouchMode VoodooPS2TouchPadBase::gestureTransition(TouchMode mode, GestureEvent event)
+{
+    for (int i = 0; i < countof(gestureTransitions); i++)
+    {
+        const GestureTransition& t = gestureTransitions[i];
+        if (t.event == event && (t.from == mode || t.from == MODE_ANY))
+            return t.to;
+    }
+    return mode;
+}
+
+//
+// Gesture recognizer: tap, drag, drag lock, multi-finger scroll and swipe.
+// Takes one packet of normalized input and fills in the pointer motion and
+// buttons to report; scroll and swipe events are dispatched from here.
+// Returns false when the packet is to be ignored altogether. Nothing in
+// here depends on the touchpad protocol.
+//
+
+bool VoodooPS2TouchPadBase::recognizeGesture(GestureFrame& f)
+{
+    int x = f.x;
+    int y = f.y;
+    int z = f.z;
+    int fingers = f.fingers;
+    UInt32 buttonsraw = f.buttons;
+    uint64_t now_abs = f.now_abs;
+    uint64_t now_ns = f.now_ns;
+    int rawx = x, rawy = y;
+    
+    // centroid of the tracked contacts: steadier than the primary contact
+    // alone for multi-finger scrolls and swipes, but only comparable
+    // between packets that have the same set of contacts
+    int cx = x, cy = y;
+    bool cvalid = false;
+    if (f.ncontacts >= 2) {
+        cx = cy = 0;
+        for (int i = 0; i < f.ncontacts; i++) {
+            cx += f.contactx[i];
+            cy += f.contacty[i];
+        }
+        cx /= f.ncontacts;
+        cy /= f.ncontacts;
+        cvalid = lastcvalid && !f.contactschanged;
+    }
+    
+    fingers = z > z_finger ? fingers : 0;
+    
+    // allow middle click to be simulated the other two physical buttons
+    UInt32 buttons = buttonsraw;
+    lastbuttons = buttons;
+    
+    // allow middle button to be simulated with two buttons down
+    if (!clickpadtype || fingers == 3) {
+        buttons = middleButton(buttons, now_abs, fingers == 3 ? fromPassthru : fromTrackpad);
+        DEBUG_LOG("New buttons value after check for middle click: %d\n", buttons);
+    }
+    
+    // recalc middle buttons if finger is going down
+    if (0 == last_fingers && fingers > 0) {
+        buttons = middleButton(buttonsraw | passbuttons, now_abs, fromCancel);
+    }
+    
+    if (last_fingers > 0 && fingers > 0 && last_fingers != fingers &&
+        f.primarychanged) {
+        // ignore deltas for up to FingerChangeIgnoreDeltas packets after
+        // a finger change, unless the contact tracker has kept the same
+        // finger as the primary one
+        ignoredeltas = ignoredeltasstart;
+    }
+    
+    if (last_fingers != fingers) {
+        // never merge motion across a finger change
+        flushCoalescedEvents();
+        // reset averages after finger change, unless the same finger
+        // stayed down as the primary contact
+        if (!last_fingers || !fingers || f.primarychanged) {
+            DEBUG_LOG("Finger change, reset averages\n");
+            x_undo.reset();
+            y_undo.reset();
+            x_avg.reset();
+            y_avg.reset();
+            x_adapt.reset();
+            y_adapt.reset();
+        }
+        // a new scroll has to get past the thresholds again
+        scrollstarted = false;
+        xrest = yrest = 0;
+        // a swipe belongs to one finger count
+        endSwipe(now_ns);
+    }
+    
+    // unsmooth input (probably just for testing)
+    // by default the trackpad itself does a simple decaying average (1/2 each)
+    // we can undo it here
+    if (unsmoothinput) {
+        x = x_undo.filter(x);
+        y = y_undo.filter(y);
+    }
+    
+    // smooth input by unweighted average, or adaptively (SmoothFilterX/Y)
+    if (smoothinput) {
+        x = smoothfilterx ? x_adapt.filter(x) : x_avg.filter(x);
+        y = smoothfiltery ? y_adapt.filter(y) : y_avg.filter(y);
+    }
+    
+    // predict where the finger is PredictionTime from now
+    if (predicttime) {
+        int px = 0, py = 0;
+        if (fingers && fingers == last_fingers && predictvalid) {
+            int vx = x - predictlastx;
+            int vy = y - predictlasty;
+            uint64_t interval = (now_ns - predictlasttime) >> 20;
+            // no prediction across a direction reversal or a gap in the stream
+            if ((int64_t) vx * predictdx >= 0 && (int64_t) vy * predictdy >= 0 && interval < kAccelIntervals) {
+                if (interval < 1)
+                    interval = 1;
+                int64_t lead = (int64_t) (predicttime >> 20) * accelrecip[interval];
+                px = (int) ((vx * lead) >> 16);
+                py = (int) ((vy * lead) >> 16);
+                px = px > predictmax ? predictmax : px < -predictmax ? -predictmax : px;
+                py = py > predictmax ? predictmax : py < -predictmax ? -predictmax : py;
+            }
+            predictdx = vx;
+            predictdy = vy;
+        } else {
+            predictdx = predictdy = 0;
+        }
+        predictvalid = fingers != 0;
+        predictlastx = x;
+        predictlasty = y;
+        predictlasttime = now_ns;
+        x += px;
+        y += py;
+    }
+    
+    // the primary contact is settled once it lands within
+    // FingerChangeStableDelta of where it was the packet before,
+    // so motion can resume before the window runs out
+    if (ignoredeltas && ignorestabledelta &&
+        abs(rawx - ignorelastx) <= ignorestabledelta && abs(rawy - ignorelasty) <= ignorestabledelta) {
+        DEBUG_LOG("ps2: Primary contact stable after %d ignored packets\n", ignoredcount);
+        ignoredeltas = 0;
+        ignoredcount = 0;
+    }
+    ignorelastx = rawx;
+    ignorelasty = rawy;
+    
+    if (ignoredeltas) {
+        DEBUG_LOG("ps2: Still ignoring deltas. Value=%d\n", ignoredeltas);
+        lastx = x;
+        lasty = y;
+        cvalid = false;
+        ignoredcount++;
+        ignoredpackets++;
+        if (--ignoredeltas == 0) {
+            DEBUG_LOG("ps2: Ignored %d packets after finger change\n", ignoredcount);
+            ignoredcount = 0;
+            x_undo.reset();
+            y_undo.reset();
+            x_avg.reset();
+            y_avg.reset();
+            x_adapt.reset();
+            y_adapt.reset();
+        }
+    }
+    
+    // multi-finger motion: by the centroid when it can be compared,
+    // otherwise by the primary contact
+    int mdx = cvalid ? cx - lastcx : x - lastx;
+    int mdy = cvalid ? cy - lastcy : y - lasty;
+    lastcx = cx;
+    lastcy = cy;
+    lastcvalid = f.ncontacts >= 2;
+    
+    // deal with "OutsidezoneNoAction When Typing"
+    if (outzone_wt && z > z_finger && now_ns - keytime < maxaftertyping &&
+        (x < zonel || x > zoner || y < zoneb || y > zonet)) {
+        DEBUG_LOG("Ignore touch input after typing\n");
+        // touch input was shortly after typing and outside the "zone"
+        // ignore it...
+        return false;
+    }
+    
+    // if trackpad input is supposed to be ignored, then don't do anything
+    if (ignoreall) {
+        DEBUG_LOG("ignoreall is set, returning\n");
+        return false;
+    }
+    
+#ifdef DEBUG
+    int tm1 = touchmode;
+#endif
+    DEBUG_LOG("VoodooPS2::Mode: %d\n", touchmode);
+    if (z < z_finger && isTouchMode()) {
+        // Finger has been lifted
+        DEBUG_LOG("finger lifted after touch\n");
+        xrest = yrest = scrollrest = 0;
+        xrestq = yrestq = 0;
+        scrollrestxq = scrollrestyq = 0;
+        scrollstarted = false;
+        inSwipeLeft = inSwipeRight = inSwipeUp = inSwipeDown = 0;
+        inSwipe4Left = inSwipe4Right = inSwipe4Up = inSwipe4Down = 0;
+        xmoved = ymoved = 0;
+        endSwipe(now_ns);
+        untouchtime = now_ns;
+        
+        // publish the finger change ignore count once per touch, if it moved
+        if (ignoredpackets != ignoredpacketsshown) {
+            ignoredpacketsshown = ignoredpackets;
+            setProperty("FingerChangeIgnoredPackets", ignoredpackets, 32);
+        }
+        
+        DEBUG_LOG("finger lifted -> touchmode: %d history: %d", touchmode, time_history.count());
+        DEBUG_LOG("PS2: wastriple: %d wasdouble: %d touchtime: %llu", wastriple, wasdouble, touchtime);
+        
+        // check for scroll momentum start
+        if ((MODE_MTOUCH == touchmode || MODE_VSCROLL == touchmode) && momentumscroll && momentumscrolltimer) {
+            // releasing when we were in touchmode -- check for momentum scroll
+            if (time_history.count() > momentumscrollsamplesmin)
+                startMomentumScroll(now_abs);
+        }
+        resetScrollHistory();
+        
+        if (now_ns - touchtime < maxtaptime && clicking) {
+            // a tap: a single finger tap may lead into a drag, anything else ends here
+            GestureEvent event = (((wastriple || wasdouble) && rtap) || !dragging) ? GESTURE_CLICK : GESTURE_TAP;
+            switch (touchmode) {
+                case MODE_DRAGLOCK:
+                    break;
+                    
+                case MODE_DRAG:
+                    if (!immediateclick) {
+                        buttons &= ~0x7;
+                        dispatchRelativePointerEventX(0, 0, buttons | 0x1, now_abs);
+                        dispatchRelativePointerEventX(0, 0, buttons, now_abs);
+                    }
+                    // fall through
+                default: //dispatch taps
+                    if (wastriple && rtap) {
+                        buttons |= !swapdoubletriple ? 0x4 : 0x02;
+                    } else if (wasdouble && rtap) {
+                        buttons |= !swapdoubletriple ? 0x2 : 0x04;
+                    } else {
+                        buttons |= 0x1;
+                    }
+                    break;
+            }
+            touchmode = gestureTransition(touchmode, event);
+        }
+        else {
+            bool hold = draglock || draglocktemp || (dragTimer && dragexitdelay);
+            touchmode = gestureTransition(touchmode, hold ? GESTURE_LIFT_HOLD : GESTURE_LIFT);
+            if (MODE_DRAGNOTOUCH == touchmode) {
+                if (!draglock && !draglocktemp)
+                {
+                    cancelTimer(dragTimer);
+                    setTimerTimeout(dragTimer, dragexitdelay);
+                }
+            } else {
+                draglocktemp = 0;
+            }
+        }
+        wasdouble = false;
+        wastriple = false;
+    }
+    
+    // cancel pre-drag mode if second tap takes too long
+    if (touchmode == MODE_PREDRAG && now_ns - untouchtime >= maxdragtime) {
+        DEBUG_LOG("cancel pre-drag since second tap took too long\n");
+        touchmode = gestureTransition(touchmode, GESTURE_TIMEOUT);
+    }
+    
+    // Note: This test should probably be done somewhere else, especially if to
+    // implement more gestures in the future, because this information we are
+    // erasing here (time of touch) might be useful for certain gestures...
+    
+    // cancel tap if touch point moves too far
+    if (isTouchMode() && isFingerTouch(z) && last_fingers == fingers) {
+        int dy = abs(touchy-y);
+        int dx = abs(touchx-x);
+        DEBUG_LOG("PS2: Cancel DX: %d Cancel DY: %d", dx, dy);
+        if (!wasdouble && !wastriple && (dx > tapthreshx || dy > tapthreshy)) {
+            touchtime = 0;
+        }
+        else if (dx > dblthreshx || dy > dblthreshy) {
+            touchtime = 0;
+        }
+    }
+    
+#ifdef DEBUG
+    int tm2 = touchmode;
+#endif
+    int dx = 0, dy = 0;
+    
+    switch (touchmode) {
+        case MODE_DRAG:
+        case MODE_DRAGLOCK:
+            if (MODE_DRAGLOCK == touchmode || (!immediateclick || now_ns - touchtime > maxdbltaptime)) {
+                buttons |= 0x1;
+            }
+            // fall through
+        case MODE_MOVE:
+            if (last_fingers == fingers && z<=zlimit)
+            {
+                if (now_ns - touchtime > 100000000) {
+                    if(wasScroll) {
+                        wasScroll = false;
+                        ignoredeltas = ignoredeltasstart;
+                        break;
+                    }
+                    dx = x-lastx;
+                    dy = lasty-y;
+                    if (abs(dx) > bogusdxthresh || abs(dy) > bogusdythresh) {
+                        dx = dy = 0;
+                        xrestq = yrestq = 0;
+                    }
+                }
+            }
+            break;
+            
+        case MODE_MTOUCH:
+            switch (fingers) {
+                case 1:
+                    if (last_fingers != fingers) break;
+                    
+                    // transition from multitouch to single touch
+                    // user could be letting go - ignore single for a few
+                    // packets to see if they completely let go before
+                    // starting to move w/ single finger
+                    if (!wsticky && !scrolldebounce && !ignoresingle)
+                    {
+                        cancelTimer(scrollDebounceTIMER);
+                        setTimerTimeout(scrollDebounceTIMER, scrollexitdelay);
+                        scrolldebounce = true;
+                        wasScroll = true;
+                        resetScrollHistory();
+                        touchmode = gestureTransition(touchmode, GESTURE_SINGLE);
+                        break;
+                    }
+                    
+                    // Decrement ignore single counter
+                    if (ignoresingle)
+                        ignoresingle--;
+                    
+                    break;
+                case 2: // two finger
+                    if (last_fingers != fingers) {
+                        break;
+                    }
+                    if (palm && z > zlimit) {
+                        break;
+                    }
+                    if (palm_wt && now_ns - keytime < maxaftertyping) {
+                        break;
+                    }
+                    dy = (wvdivisor) ? mdy : 0;
+                    dx = (whdivisor&&hscroll) ? mdx : 0;
+                    // check for stopping or changing direction
+                    DEBUG_LOG("fingers dx: %d dy: %d", dx, dy);
+                    if ((!dx && !dy) ||
+                        (dx && scrolldirx && (dx < 0) != (scrolldirx < 0)) ||
+                        (dy && scrolldiry && (dy < 0) != (scrolldiry < 0))) {
+                        // stopped or changed direction, clear history
+                        resetScrollHistory();
+                    }
+                    if (dx)
+                        scrolldirx = dx;
+                    if (dy)
+                        scrolldiry = dy;
+                    // put position and time in history for later
+                    x_history.filter(x);
+                    y_history.filter(y);
+                    time_history.filter(now_abs);
+                    // Don't move unless user is moved fingers far enough to know this wasn't a two finger tap
+                    // Gets rid of scrolling while trying to tap
+                    if (touchtime) {
+                        dx = dy = 0;
+                        break;
+                    }
+                    //REVIEW: filter out small movements (Mavericks issue)
+                    // only until the scroll gets going, after that every bit counts
+                    if (!scrollstarted) {
+                        xrest += dx;
+                        yrest += dy;
+                        if (abs(xrest) < scrolldxthresh && abs(yrest) < scrolldythresh) {
+                            dx = dy = 0;
+                            break;
+                        }
+                        dx = xrest;
+                        dy = yrest;
+                        xrest = yrest = 0;
+                        scrollstarted = true;
+                    }
+                    if (0 != dy || 0 != dx)
+                    {
+                        // scroll divisors and acceleration in Q16, at most one event per packet
+                        int gain = scrollaccelenabled ? scrollaccelgain[accelSpeed(dx, dy, now_ns)] : 256;
+                        scrollrestxq += ((int64_t) dx * whdivinv * gain) >> 8;
+                        scrollrestyq += ((int64_t) dy * wvdivinv * gain) >> 8;
+                        int sx = q16Take(&scrollrestxq);
+                        int sy = q16Take(&scrollrestyq);
+                        if (sx || sy)
+                            dispatchScrollWheelEventX(sy, -sx, 0, now_abs);
+                        dx = dy = 0;
+                        ignoresingle = 3;
+                    }
+                    break;
+                    
+                case 3: // three finger
+                    if (last_fingers != fingers) {
+                        break;
+                    }
+                    
+                    if (threefingerhorizswipe || threefingervertswipe) {
+                        trackSwipe(fingers, mdx, mdy, now_ns);
+                        
+                        // Now calculate total movement since 3 fingers down (add to total)
+                        xmoved -= mdx;
+                        ymoved += mdy;
+                        
+                        // dispatching 3 finger movement
+                        if (ymoved > swipeThreshold(swipedy, swipevy) && !inSwipeUp && !inSwipe4Up && threefingervertswipe) {
+                            inSwipeUp = 1;
+                            inSwipeDown = 0;
+                            ymoved = 0;
+                            commitSwipe(kPS2M_swipeUp, now_abs);
+                            break;
+                        }
+                        if (ymoved < -swipeThreshold(swipedy, swipevy) && !inSwipeDown && !inSwipe4Down && threefingervertswipe) {
+                            inSwipeDown = 1;
+                            inSwipeUp = 0;
+                            ymoved = 0;
+                            commitSwipe(kPS2M_swipeDown, now_abs);
+                            break;
+                        }
+                        if (xmoved < -swipeThreshold(swipedx, swipevx) && !inSwipeRight && !inSwipe4Right && threefingerhorizswipe) {
+                            inSwipeRight = 1;
+                            inSwipeLeft = 0;
+                            xmoved = 0;
+                            commitSwipe(kPS2M_swipeRight, now_abs);
+                            break;
+                        }
+                        if (xmoved > swipeThreshold(swipedx, swipevx) && !inSwipeLeft && !inSwipe4Left && threefingerhorizswipe) {
+                            inSwipeLeft = 1;
+                            inSwipeRight = 0;
+                            xmoved = 0;
+                            commitSwipe(kPS2M_swipeLeft, now_abs);
+                            break;
+                        }
+                    }
+                    break;
+                    
+                case 4: // four fingers
+                    if (last_fingers != fingers) {
+                        break;
+                    }
+                    
+                    trackSwipe(fingers, mdx, mdy, now_ns);
+                    
+                    // Now calculate total movement since 4 fingers down (add to total)
+                    xmoved -= mdx;
+                    ymoved += mdy;
+                    
+                    // dispatching 4 finger movement
+                    if (ymoved > swipeThreshold(swipedy, swipevy) && !inSwipe4Up) {
+                        inSwipe4Up = 1; inSwipeUp = 0;
+                        inSwipe4Down = 0;
+                        ymoved = 0;
+                        commitSwipe(kPS2M_swipe4Up, now_abs);
+                        break;
+                    }
+                    if (ymoved < -swipeThreshold(swipedy, swipevy) && !inSwipe4Down) {
+                        inSwipe4Down = 1; inSwipeDown = 0;
+                        inSwipe4Up = 0;
+                        ymoved = 0;
+                        commitSwipe(kPS2M_swipe4Down, now_abs);
+                        break;
+                    }
+                    if (xmoved < -swipeThreshold(swipedx, swipevx) && !inSwipe4Right) {
+                        inSwipe4Right = 1; inSwipeRight = 0;
+                        inSwipe4Left = 0;
+                        xmoved = 0;
+                        commitSwipe(kPS2M_swipe4Right, now_abs);
+                        break;
+                    }
+                    if (xmoved > swipeThreshold(swipedx, swipevx) && !inSwipe4Left) {
+                        inSwipe4Left = 1; inSwipeLeft = 0;
+                        inSwipe4Right = 0;
+                        xmoved = 0;
+                        commitSwipe(kPS2M_swipe4Left, now_abs);
+                        break;
+                    }
+            }
+            break;
+        case MODE_DRAGNOTOUCH:
+            buttons |= 0x1;
+            // fall through
+        case MODE_PREDRAG:
+            if (!immediateclick && (!palm_wt || now_ns - keytime >= maxaftertyping)) {
+                buttons |= 0x1;
+            }
+        case MODE_NOTOUCH:
+            break;
+            
+        default:
+            ; // nothing
+    }
+    
+    // capture time of tap, and watch for double/triple tap
+    if (isFingerTouch(z)) {
+        // taps don't count if too close to typing or if currently in momentum scroll
+        if ((!palm_wt || now_ns - keytime >= maxaftertyping) && !momentumscrollcurrent) {
+            
+            if (!isTouchMode()) {
+                touchtime = now_ns;
+            }
+            
+            if (last_fingers < fingers) {
+                touchx = x;
+                touchy = y;
+            }
+            
+            DEBUG_LOG("PS2:Checking Fingers");
+            wasdouble = fingers == 2 || (wasdouble && last_fingers != fingers);// && !scrolldebounce;
+            wastriple = fingers == 3 || (wastriple && last_fingers != fingers);// && !scrolldebounce;
+        }
+        
+        if(!scrolldebounce && momentumscrollcurrent){
+            // any touch cancels momentum scroll
+            momentumscrollcurrent = 0;
+            setTimerTimeout(scrollDebounceTIMER,scrollexitdelay);
+            scrolldebounce = true;
+        }
+    }
+    // switch modes, depending on input
+    if (isFingerTouch(z)) {
+        if (touchmode == MODE_PREDRAG)
+            draglocktemp = _modifierdown & draglocktempmask;
+        if (touchmode == MODE_DRAGNOTOUCH && dragTimer)
+            cancelTimer(dragTimer);
+        touchmode = gestureTransition(touchmode, GESTURE_TOUCH);
+        if (fingers > 1)
+            touchmode = gestureTransition(touchmode, GESTURE_MULTI);
+    }
+    if (z > z_finger && !scrolldebounce) {
+        touchmode = gestureTransition(touchmode, GESTURE_CONTACT);
+    }
+    
+    // apply DivisorX/Y and acceleration, keeping the fraction for the next packet
+    int gain = 256;
+    if (accelenabled && (dx || dy))
+        gain = accelgain[accelSpeed(dx, dy, now_ns)];
+    acceltime = now_ns;
+    xrestq += ((int64_t) dx * xdivinv * gain) >> 8;
+    yrestq += ((int64_t) dy * ydivinv * gain) >> 8;
+    dx = q16Take(&xrestq);
+    dy = q16Take(&yrestq);
+    
+    // report dx/dy and current button status
+    f.dx = dx;
+    f.dy = dy;
+    f.buttons = buttons;
+    
+    // always save last seen position for calculating deltas later
+    lastx = x;
+    lasty = y;
+    //b4last = last_fingers;
+    last_fingers = fingers;
+    
+#ifdef DEBUG
+    DEBUG_LOG("ps2: fingers=%d, dx=%d, dy=%d (%d,%d) z=%d mode=(%d,%d,%d) buttons=%d wasdouble=%d wastriple=%d\n", fingers, dx, dy, x, y, z, tm1, tm2, touchmode, buttons, wasdouble, wastriple);
+#endif
+    
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void VoodooPS2TouchPadBase::onDragTimer(void)
 {
     if (MODE_DRAGNOTOUCH==touchmode)
     {
-        touchmode=MODE_NOTOUCH;
+        touchmode=gestureTransition(touchmode, GESTURE_TIMEOUT);
         
         uint64_t now_abs;
-        clock_get_uptime(&now_abs);
+        now_abs = getClock()->uptime();
         UInt32 buttons = middleButton(lastbuttons & ~0x01, now_abs, fromPassthru);
         DEBUG_LOG("ps2: onDragTimer, button = %d\n", buttons);
         dispatchRelativePointerEventX(0, 0, buttons, now_abs);
@@ -642,6 +1412,137 @@ void VoodooPS2TouchPadBase::initTouchPad()
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+//
+// AccelerationCurve and ScrollAccelerationCurve are lists of speed, gain
+// pairs: speed in 6000-space units per ms, gain in 1/256 (256 leaves the
+// motion alone), speeds in increasing order. Each is compiled into a gain
+// per speed, linear between points and flat beyond the first and last one,
+// so that a packet costs two table lookups. Returns false for an empty or
+// invalid list, which turns that acceleration off.
+//
+
+bool VoodooPS2TouchPadBase::loadAccelCurve(OSArray* pArray, const char* name, UInt16* gain)
+{
+    int count = pArray->getCount();
+    if (count < 2 || (count & 1))
+    {
+        if (count)
+            IOLog("VoodooPS2Trackpad: %s needs speed, gain pairs\n", name);
+        return false;
+    }
+    
+    int prevspeed = 0, prevgain = 0;
+    int speed = 0;
+    for (int i = 0; i < count; i += 2)
+    {
+        OSNumber* pSpeed = OSDynamicCast(OSNumber, pArray->getObject(i));
+        OSNumber* pGain = OSDynamicCast(OSNumber, pArray->getObject(i+1));
+        if (NULL == pSpeed || NULL == pGain || (i && (int)pSpeed->unsigned32BitValue() <= prevspeed))
+        {
+            IOLog("VoodooPS2Trackpad: invalid %s point %d\n", name, i/2);
+            return false;
+        }
+        int pointspeed = pSpeed->unsigned32BitValue();
+        int pointgain = pGain->unsigned32BitValue();
+        if (pointgain > 0xFFFF)
+            pointgain = 0xFFFF;
+        // flat before the first point, linear from the previous point on
+        for (; speed <= pointspeed && speed < kAccelSpeeds; speed++)
+        {
+            if (!i)
+                gain[speed] = pointgain;
+            else
+                gain[speed] = prevgain + (pointgain - prevgain) * (speed - prevspeed) / (pointspeed - prevspeed);
+        }
+        prevspeed = pointspeed;
+        prevgain = pointgain;
+    }
+    // flat after the last point
+    for (; speed < kAccelSpeeds; speed++)
+        gain[speed] = prevgain;
+    
+    return true;
+}
+
+//
+// Index into the acceleration tables: distance of this packet's motion
+// (max + min/2 approximation) per ~ms since the previous packet.
+//
+
+int VoodooPS2TouchPadBase::accelSpeed(int dx, int dy, uint64_t now_ns)
+{
+    int adx = abs(dx), ady = abs(dy);
+    int dist = adx > ady ? adx + (ady >> 1) : ady + (adx >> 1);
+    uint64_t interval = (now_ns - acceltime) >> 20;
+    if (interval < 1)
+        interval = 1;
+    if (interval >= kAccelIntervals)
+        interval = kAccelIntervals - 1;
+    int speed = (int) (((int64_t) dist * accelrecip[interval]) >> 16);
+    return speed < kAccelSpeeds ? speed : kAccelSpeeds - 1;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void VoodooPS2TouchPadBase::trackSwipe(int fingers, int dx, int dy, uint64_t now_ns)
+{
+    if (swipefingers != fingers) {
+        endSwipe(now_ns);
+        swipefingers = fingers;
+        swipetotalx = swipetotaly = 0;
+        swipevx = swipevy = 0;
+        swipelasttime = now_ns;
+        swipecommitted = -1;
+        sendSwipeInfo(kPS2M_swipeBegin, now_ns);
+    }
+    swipetotalx += dx;
+    swipetotaly += dy;
+    
+    // velocity over the packet interval, averaged with the previous one;
+    // intervals below 1ms are noise from bunched up packets
+    uint64_t interval = now_ns - swipelasttime;
+    if (interval < 1000000)
+        interval = 1000000;
+    swipevx = (swipevx + (int) ((int64_t) dx * 1000000000 / (int64_t) interval)) / 2;
+    swipevy = (swipevy + (int) ((int64_t) dy * 1000000000 / (int64_t) interval)) / 2;
+    swipelasttime = now_ns;
+    
+    sendSwipeInfo(kPS2M_swipeUpdate, now_ns);
+}
+
+void VoodooPS2TouchPadBase::commitSwipe(int message, uint64_t now_abs)
+{
+    DEBUG_LOG("PS2: swipe commit %d velocity %d,%d\n", message, swipevx, swipevy);
+    swipecommitted = message;
+    _device->dispatchKeyboardMessage(message, &now_abs);
+}
+
+void VoodooPS2TouchPadBase::endSwipe(uint64_t now_ns)
+{
+    if (!swipefingers)
+        return;
+    sendSwipeInfo(kPS2M_swipeEnd, now_ns);
+    swipefingers = 0;
+    swipevx = swipevy = 0;
+}
+
+void VoodooPS2TouchPadBase::sendSwipeInfo(int message, uint64_t now_ns)
+{
+    if (!swipecontinuous)
+        return;
+    PS2SwipeInfo info;
+    info.time = now_ns;
+    info.fingers = swipefingers;
+    info.dx = swipetotalx;
+    info.dy = swipetotaly;
+    info.vx = swipevx;
+    info.vy = swipevy;
+    info.committed = swipecommitted;
+    _device->dispatchKeyboardMessage(message, &info);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
 {
 	if (NULL == config)
@@ -687,6 +1588,8 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"ScrollResolution",                &_scrollresolution},
         {"SwipeDeltaX",                     &swipedx},
         {"SwipeDeltaY",                     &swipedy},
+        {"SwipeFlickVelocity",              &swipeflickvelocity},
+        {"SwipeFlickDelta",                 &swipeflickdelta},
         {"MouseCount",                      &mousecount},
         {"RightClickZoneLeft",              &rczl},
         {"RightClickZoneRight",             &rczr},
@@ -700,12 +1603,19 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"MomentumScrollDivisor",           &momentumscrolldivisor},
         {"MomentumScrollSamplesMin",        &momentumscrollsamplesmin},
         {"FingerChangeIgnoreDeltas",        &ignoredeltasstart},
+        {"FingerChangeStableDelta",         &ignorestabledelta},
         {"BogusDeltaThreshX",               &bogusdxthresh},
         {"BogusDeltaThreshY",               &bogusdythresh},
         {"UnitsPerMMX",                     &xupmm},
         {"UnitsPerMMY",                     &yupmm},
         {"ScrollDeltaThreshX",              &scrolldxthresh},
         {"ScrollDeltaThreshY",              &scrolldythresh},
+        {"CoalesceThreshold",               &coalescethreshold},
+        {"SmoothFilterX",                   &smoothfilterx},
+        {"SmoothFilterY",                   &smoothfiltery},
+        {"SmoothMinAlpha",                  &smoothminalpha},
+        {"SmoothBeta",                      &smoothbeta},
+        {"PredictionMax",                   &predictmax},
         {"TrackpadThreeFingerVertSwipeGesture", &threefingervertswipe},
         {"TrackpadThreeFingerHorizSwipeGesture", &threefingerhorizswipe},
 	};
@@ -723,6 +1633,7 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"ImmediateClick",                  &immediateclick},
         {"MouseMiddleScroll",               &mousemiddlescroll},
         {"FakeMiddleButton",                &_fakemiddlebutton},
+        {"SwipeContinuous",                 &swipecontinuous},
 	};
     const struct {const char* name; bool* var;} lowbitvars[]={
         {"Clicking",                        &clicking},
@@ -748,6 +1659,7 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         {"MiddleClickTime",                 &_maxmiddleclicktime},
         {"DragExitDelayTime",               &dragexitdelay},
         {"ScrollExitDelayTime",             &scrollexitdelay},
+        {"PredictionTime",                  &predicttime},
     };
     
     int oldmousecount = mousecount;
@@ -828,6 +1740,37 @@ void VoodooPS2TouchPadBase::setParamPropertiesGated(OSDictionary * config)
         divisorx = 1;
     if (!divisory)
         divisory = 1;
+    xdivinv = (65536 + divisorx / 2) / divisorx;
+    ydivinv = (65536 + divisory / 2) / divisory;
+    xrestq = yrestq = 0;
+
+    // pointer and scroll acceleration curves
+    OSArray* curve = OSDynamicCast(OSArray, config->getObject("AccelerationCurve"));
+    if (curve)
+    {
+        accelenabled = loadAccelCurve(curve, "AccelerationCurve", accelgain);
+        setProperty("AccelerationCurve", curve);
+    }
+    curve = OSDynamicCast(OSArray, config->getObject("ScrollAccelerationCurve"));
+    if (curve)
+    {
+        scrollaccelenabled = loadAccelCurve(curve, "ScrollAccelerationCurve", scrollaccelgain);
+        setProperty("ScrollAccelerationCurve", curve);
+    }
+
+    // scroll divisor reciprocals, and momentum scroll decay per tick
+    wvdivinv = wvdivisor ? (65536 + wvdivisor / 2) / wvdivisor : 0;
+    whdivinv = whdivisor ? (65536 + whdivisor / 2) / whdivisor : 0;
+    scrollrestxq = scrollrestyq = 0;
+    if (momentumscrolldivisor <= 0)
+        momentumscrolldivisor = 100;
+    momentumdecay[0] = 65536;
+    for (int i = 1; i < kMomentumTicks; i++)
+        momentumdecay[i] = (UInt32) (((uint64_t) momentumdecay[i-1] * momentumscrollmultiplier + momentumscrolldivisor / 2) / momentumscrolldivisor);
+
+    // adaptive smoothing
+    x_adapt.setParams(smoothminalpha, smoothbeta);
+    y_adapt.setParams(smoothminalpha, smoothbeta);
 
     // bogusdeltathreshx/y = 0 is MAX_INT
     if (!bogusdxthresh)
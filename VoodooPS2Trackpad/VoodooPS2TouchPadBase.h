@@ -15,7 +15,19 @@
 // VoodooPS2TouchPadBase Class Declaration
 //
 
-#define kPacketLength 6
+#define kPacketLength (8+8)    // up to 8 bytes of packet data, 8 bytes for timestamp
+#define kPacketTimeOffset 8
+
+// pointer acceleration table: speeds in 6000-space units per ms, packet
+// intervals in 2^20 ns (~1 ms) steps
+#define kAccelSpeeds 128
+#define kAccelIntervals 64
+
+// momentum scroll: decay table length in timer ticks
+#define kMomentumTicks 512
+
+// tracked contacts handed to the gesture recognizer
+#define kMaxContacts 4
 
 class EXPORT VoodooPS2TouchPadBase : public IOHIPointing
 {
@@ -24,15 +36,24 @@ class EXPORT VoodooPS2TouchPadBase : public IOHIPointing
 
 protected:
     ApplePS2MouseDevice * _device;
+    PS2Clock*           _clock;
+    PS2KernelClock      _kernelClock;
     bool                _interruptHandlerInstalled;
     bool                _powerControlHandlerInstalled;
     bool                _messageHandlerInstalled;
     RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
+    uint64_t            _packetTime;        // arrival time of the packet being processed
     UInt32              _packetByteCount;
     UInt8               _lastdata;
     UInt16              _touchPadVersion;
 
     IOCommandGate*      _cmdGate;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // configuration: set by setParamPropertiesGated, only read per packet
+    //
+    // grouped apart from the per packet state below
+    //
     int z_finger;
 	int divisorx, divisory;
 	int ledge;
@@ -80,113 +101,62 @@ protected:
     uint64_t clickpadclicktime;
     int clickpadtrackboth;
     int ignoredeltasstart;
+    int ignorestabledelta;
     int bogusdxthresh, bogusdythresh;
     int scrolldxthresh, scrolldythresh;
     int immediateclick;
-
-    // three finger and four finger state
-    uint8_t inSwipeLeft, inSwipeRight;
-    uint8_t inSwipeUp, inSwipeDown;
-    uint8_t inSwipe4Left, inSwipe4Right;
-    uint8_t inSwipe4Up, inSwipe4Down;
-    int xmoved, ymoved;
-
+    int coalescethreshold;
     int rczl, rczr, rczb, rczt; // rightclick zone for 1-button ClickPads
-
-    // state related to secondary packets/extendedwmode
-    int lastx2, lasty2;
-    bool tracksecondary;
-    int xrest2, yrest2;
-    bool clickedprimary;
-    bool _extendedwmode;
-
-    // normal state
-	int lastx, lasty, last_fingers, b4last;
-    UInt32 lastbuttons;
-    UInt32 lastTrackStickButtons, lastTouchpadButtons;
-    int ignoredeltas;
-    int ignoresingle;
-	int xrest, yrest, scrollrest;
-    int touchx, touchy;
-	uint64_t touchtime;
-	uint64_t untouchtime;
-	bool wasdouble,wastriple;
-    bool scrolldebounce;
-    uint64_t keytime;
-    bool ignoreall;
-    UInt32 passbuttons;
-#ifdef SIMULATE_PASSTHRU
-    UInt32 trackbuttons;
-#endif
     bool passthru;
     bool ledpresent;
     bool _reportsv;
     int clickpadtype;   //0=not, 1=1button, 2=2button, 3=reserved
-    UInt32 _clickbuttons;  //clickbuttons to merge into buttons
     int mousecount;
     bool usb_mouse_stops_trackpad;
-
-    int _modifierdown; // state of left+right control keys
     int scrollzoommask;
+    bool _extendedwmode;
 
     // for scaling x/y values
     int xupmm, yupmm;
 
-    // for middle button simulation
-    enum mbuttonstate
-    {
-        STATE_NOBUTTONS,
-        STATE_MIDDLE,
-        STATE_WAIT4TWO,
-        STATE_WAIT4NONE,
-        STATE_NOOP,
-    } _mbuttonstate;
+    // DivisorX/Y as Q16 reciprocals
+    int xdivinv, ydivinv;
+
+    // motion prediction: how far ahead, and the largest offset
+    uint64_t predicttime;
+    int predictmax;
+
+    // continuous swipe and flick settings
+    int swipecontinuous;
+    int swipeflickvelocity, swipeflickdelta;
+
+    int smoothfilterx, smoothfiltery;   // 0=moving average, 1=adaptive
+    int smoothminalpha, smoothbeta;
 
-    UInt32 _pendingbuttons;
-    uint64_t _buttontime;
-    IOTimerEventSource* _buttonTimer;
     uint64_t _maxmiddleclicktime;
     int _fakemiddlebutton;
 
-    // momentum scroll state
+    // timer for drag delay
+    uint64_t dragexitdelay;
+    uint64_t scrollexitdelay;
+
+    // momentum scroll settings
     bool momentumscroll;
-    bool wasScroll = false;
-    SimpleAverage<int, 32> dy_history;
-    SimpleAverage<uint64_t, 32> time_history;
-    IOTimerEventSource* scrollTimer;
-    uint64_t momentumscrolltimer;
+    uint64_t momentumscrolltimer;       // timer period in ns
     int momentumscrollthreshy;
-    uint64_t momentumscrollinterval;
-    int momentumscrollsum;
-    int64_t momentumscrollcurrent;
-    int64_t momentumscrollrest1;
     int momentumscrollmultiplier;
     int momentumscrolldivisor;
-    int momentumscrollrest2;
     int momentumscrollsamplesmin;
+    int wvdivinv, whdivinv;             // scroll divisors as Q16 reciprocals
 
-    // timer for drag delay
-    uint64_t dragexitdelay;
-    uint64_t scrollexitdelay;
-    IOTimerEventSource* dragTimer;
-    
-    IOTimerEventSource* scrollDebounceTIMER;
-    
-    SimpleAverage<int, 5> x_avg;
-    SimpleAverage<int, 5> y_avg;
-    //DecayingAverage<int, int64_t, 1, 1, 2> x_avg;
-    //DecayingAverage<int, int64_t, 1, 1, 2> y_avg;
-    UndecayAverage<int, int64_t, 1, 1, 2> x_undo;
-    UndecayAverage<int, int64_t, 1, 1, 2> y_undo;
-
-    SimpleAverage<int, 5> x2_avg;
-    SimpleAverage<int, 5> y2_avg;
-    //DecayingAverage<int, int64_t, 1, 1, 2> x2_avg;
-    //DecayingAverage<int, int64_t, 1, 1, 2> y2_avg;
-    UndecayAverage<int, int64_t, 1, 1, 2> x2_undo;
-    UndecayAverage<int, int64_t, 1, 1, 2> y2_undo;
+    // pointer and scroll acceleration: gain (1/256) by speed, and 65536/interval
+    bool accelenabled;
+    bool scrollaccelenabled;
+    UInt16 accelgain[kAccelSpeeds];
+    UInt16 scrollaccelgain[kAccelSpeeds];
+    UInt32 accelrecip[kAccelIntervals];
 
-	enum
+	enum TouchMode
     {
         // "no touch" modes... must be even (see isTouchMode)
         MODE_NOTOUCH =      0,
@@ -207,10 +177,185 @@ protected:
         MODE_WAIT1RELEASE = 101,    // "touch"
         MODE_WAIT2TAP =     102,    // "no touch"
         MODE_WAIT2RELEASE = 103,    // "touch"
-    } touchmode;
+    };
+
+    // for middle button simulation
+    enum mbuttonstate
+    {
+        STATE_NOBUTTONS,
+        STATE_MIDDLE,
+        STATE_WAIT4TWO,
+        STATE_WAIT4NONE,
+        STATE_NOOP,
+    };
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // per packet state: everything recognizeGesture reads and writes on
+    // every packet, kept together
+    //
+    TouchMode touchmode;
+
+    // normal state
+	int lastx, lasty, last_fingers, b4last;
+    UInt32 lastbuttons;
+    UInt32 lastTrackStickButtons, lastTouchpadButtons;
+    UInt32 passbuttons;
+#ifdef SIMULATE_PASSTHRU
+    UInt32 trackbuttons;
+#endif
+    UInt32 _clickbuttons;  //clickbuttons to merge into buttons
+	int xrest, yrest, scrollrest;
+    int64_t xrestq, yrestq;             // pointer motion DivisorX/Y leave over
+    int64_t scrollrestxq, scrollrestyq; // same for two finger scroll
+    bool scrollstarted;
+	bool wasdouble,wastriple;
+    bool scrolldebounce;
+    bool ignoreall;
+    bool wasScroll = false;
+    int ignoredeltas;
+    int ignoredcount;
+    int ignorelastx, ignorelasty;
+    int ignoresingle;
+    int touchx, touchy;
+	uint64_t touchtime;
+	uint64_t untouchtime;
+    uint64_t keytime;
+    uint64_t acceltime;
+
+    mbuttonstate _mbuttonstate;
+    UInt32 _pendingbuttons;
+    uint64_t _buttontime;
+
+    // motion prediction: finger history
+    bool predictvalid;
+    int predictlastx, predictlasty;
+    int predictdx, predictdy;
+    uint64_t predictlasttime;
+
+    // motion coalescing while a packet backlog is drained
+    bool coalescing;
+    bool coalescepointer, coalescescroll;
+    int coalescedx, coalescedy;
+    UInt32 coalescebuttons;
+    int coalescescroll1, coalescescroll2, coalescescroll3;
+    uint64_t coalescetime;
+
+    // three finger and four finger state
+    uint8_t inSwipeLeft, inSwipeRight;
+    uint8_t inSwipeUp, inSwipeDown;
+    uint8_t inSwipe4Left, inSwipe4Right;
+    uint8_t inSwipe4Up, inSwipe4Down;
+    int xmoved, ymoved;
+
+    // centroid of the tracked contacts in the last packet
+    int lastcx, lastcy;
+    bool lastcvalid;
+
+    // continuous swipe: fingers in the swipe (0 when none), distance moved
+    // since it began, velocity in units per second, and the kPS2M_swipe*
+    // it committed to
+    int swipefingers;
+    int swipetotalx, swipetotaly;
+    int swipevx, swipevy;
+    uint64_t swipelasttime;
+    int swipecommitted;
+
+    SimpleAverage<int, 5> x_avg;
+    SimpleAverage<int, 5> y_avg;
+    //DecayingAverage<int, int64_t, 1, 1, 2> x_avg;
+    //DecayingAverage<int, int64_t, 1, 1, 2> y_avg;
+    UndecayAverage<int, int64_t, 1, 1, 2> x_undo;
+    UndecayAverage<int, int64_t, 1, 1, 2> y_undo;
+    AdaptiveAverage<int, int64_t> x_adapt;
+    AdaptiveAverage<int, int64_t> y_adapt;
+
+    // scroll history for momentum, pushed per packet while scrolling, and
+    // the sign of the last scroll motion on each axis (0 after a reset)
+    SimpleAverage<int, 32> x_history, y_history;
+    SimpleAverage<uint64_t, 32> time_history;
+    int scrolldirx, scrolldiry;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // state touched off the packet path: timers, secondary packets, statistics
+    //
+
+    // state related to secondary packets/extendedwmode
+    int lastx2, lasty2;
+    bool tracksecondary;
+    int xrest2, yrest2;
+    bool clickedprimary;
+
+    SimpleAverage<int, 5> x2_avg;
+    SimpleAverage<int, 5> y2_avg;
+    //DecayingAverage<int, int64_t, 1, 1, 2> x2_avg;
+    //DecayingAverage<int, int64_t, 1, 1, 2> y2_avg;
+    UndecayAverage<int, int64_t, 1, 1, 2> x2_undo;
+    UndecayAverage<int, int64_t, 1, 1, 2> y2_undo;
+
+    UInt32 ignoredpackets, ignoredpacketsshown;
+    int _modifierdown; // state of left+right control keys
+
+    IOTimerEventSource* _buttonTimer;
+    IOTimerEventSource* dragTimer;
+    IOTimerEventSource* scrollDebounceTIMER;
+
+    // momentum scroll state
+    IOTimerEventSource* scrollTimer;
+    int64_t momentumscrollcurrent;      // nonzero while a fling is running
+    int64_t momentumscrollvx, momentumscrollvy;         // release velocity, Q16 units per tick
+    int64_t momentumscrollrestx, momentumscrollresty;   // Q16 scroll not yet dispatched
+    int momentumscrolltick;
+    uint64_t momentumscrolldeadline;    // next tick, in absolute time units
+    UInt32 momentumdecay[kMomentumTicks];  // Q16 velocity left after n ticks
 
     inline bool isTouchMode() { return touchmode & 1; }
 
+    // gesture recognizer: events that move touchmode, and the table of moves
+    enum GestureEvent
+    {
+        GESTURE_TAP,        // short touch lifted, may lead into a drag
+        GESTURE_CLICK,      // short touch lifted, no drag can follow
+        GESTURE_LIFT,       // longer touch lifted
+        GESTURE_LIFT_HOLD,  // longer touch lifted, drag lock or drag exit delay active
+        GESTURE_TOUCH,      // finger down
+        GESTURE_MULTI,      // more than one finger down
+        GESTURE_CONTACT,    // finger down, not debouncing a scroll
+        GESTURE_SINGLE,     // multi-finger touch went down to one finger
+        GESTURE_TIMEOUT,    // pre-drag or drag exit delay expired
+    };
+    enum { MODE_ANY = -1 };
+    struct GestureTransition
+    {
+        int from;           // TouchMode or MODE_ANY
+        GestureEvent event;
+        TouchMode to;
+    };
+    static const GestureTransition gestureTransitions[];
+    TouchMode gestureTransition(TouchMode mode, GestureEvent event);
+
+    // one packet of touch input in the 6000 unit space, and what to report for it
+    struct GestureFrame
+    {
+        int x, y, z, fingers;   // in: primary contact position (x, y updated by smoothing)
+        UInt32 buttons;         // in: physical buttons, out: buttons to report
+        bool primarychanged;    // in: a finger change moved the primary contact
+        int ncontacts;          // in: tracked contacts, 0 if the device has no tracking
+        int contactx[kMaxContacts], contacty[kMaxContacts]; // in: oldest (primary) first
+        bool contactschanged;   // in: a contact went down or up since the last packet
+        uint64_t now_abs, now_ns;
+        int dx, dy;             // out: pointer motion
+    };
+    bool recognizeGesture(GestureFrame& f);
+    bool loadAccelCurve(OSArray* pArray, const char* name, UInt16* gain);
+    int accelSpeed(int dx, int dy, uint64_t now_ns);
+    void trackSwipe(int fingers, int dx, int dy, uint64_t now_ns);
+    void commitSwipe(int message, uint64_t now_abs);
+    void endSwipe(uint64_t now_ns);
+    void sendSwipeInfo(int message, uint64_t now_ns);
+    // a fast flick commits after a shorter distance
+    inline int swipeThreshold(int delta, int v)
+        { return swipeflickvelocity && (v < 0 ? -v : v) >= swipeflickvelocity && swipeflickdelta < delta ? swipeflickdelta : delta; }
+
     inline bool isInDisableZone(int x, int y)
         { return x > diszl && x < diszr && y > diszb && y < diszt; }
 
@@ -234,6 +379,9 @@ protected:
 
     inline bool isFingerTouch(int z) { return z>z_finger; }
 
+    void startMomentumScroll(uint64_t now_abs);
+    inline void resetScrollHistory()
+        { x_history.reset(); y_history.reset(); time_history.reset(); scrolldirx = scrolldiry = 0; }
     void onScrollTimer(void);
     void onScrollDebounceTimer(void);
     void onButtonTimer(void);
@@ -247,14 +395,26 @@ protected:
 	virtual IOItemCount buttonCount();
 	virtual IOFixed     resolution();
     virtual bool deviceSpecificInit() = 0;
+    void coalesceRelativePointerEvent(int dx, int dy, UInt32 buttonState, uint64_t now);
+    void coalesceScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now);
+    void flushCoalescedEvents();
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+        { if (coalescing) coalesceRelativePointerEvent(dx, dy, buttonState, now);
+          else dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+        { if (coalescing) coalesceScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, now);
+          else dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+    inline PS2Clock* getClock()
+        { return _clock; }
+    // NULL goes back to the kernel clock
+    inline void setClock(PS2Clock* clock)
+        { _clock = clock ? clock : &_kernelClock; }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
-        { timer->setTimeout(*(AbsoluteTime*)&time); }
+        { getClock()->setTimeout(timer, time); }
+    inline void setTimerDeadline(IOTimerEventSource* timer, uint64_t deadline)
+        { getClock()->setDeadline(timer, deadline); }
     inline void cancelTimer(IOTimerEventSource* timer)
-        { timer->cancelTimeout(); }
+        { getClock()->cancelTimeout(timer); }
 
 public:
     virtual bool init( OSDictionary * properties );
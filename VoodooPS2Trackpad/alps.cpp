@@ -201,14 +201,49 @@ void ALPS::restart() {
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 bool ALPS::deviceSpecificInit() {
+    uint64_t start_abs, end_abs, full_ns, replay_ns;
     
     // Setup expected packet size
     priv.pktsize = priv.proto_version == ALPS_PROTO_V4 ? 8 : 6;
+    alps_set_byte_checks();
+    
+    // On wake, replay the command stream of the last successful init
+    if (priv.init_count) {
+        start_abs = getClock()->uptime();
+        if (alps_replay_init()) {
+            end_abs = getClock()->uptime();
+            replay_ns = getClock()->toNanoseconds(end_abs - start_abs);
+            full_ns = getClock()->toNanoseconds(priv.init_time);
+            IOLog("ALPS: Replayed %d init commands in %llu ms (full init took %llu ms)\n",
+                  priv.init_length, replay_ns / 1000000, full_ns / 1000000);
+            alps_set_report_rate(reportrate);
+            if (streamoff)
+                ps2_command_short(kDP_SetDefaultsAndDisable);
+            return true;
+        }
+        IOLog("ALPS: Init replay failed, running full initialization\n");
+        resetMouse();
+    }
+    
+    priv.init_length = 0;
+    priv.init_count = 0;
+    priv.init_recording = true;
+    start_abs = getClock()->uptime();
     
     if (!(this->*hw_init)()) {
+        priv.init_recording = false;
+        priv.init_count = 0;
         goto init_fail;
     }
     
+    end_abs = getClock()->uptime();
+    priv.init_time = end_abs - start_abs;
+    priv.init_recording = false;
+    
+    alps_set_report_rate(reportrate);
+    if (streamoff)
+        ps2_command_short(kDP_SetDefaultsAndDisable);
+    
     return true;
     
 init_fail:
@@ -217,6 +252,84 @@ init_fail:
     return false;
 }
 
+/*
+ * All blocking requests go through here so that the command stream of
+ * hw_init can be recorded. The commands are copied after they ran, so the
+ * read commands carry the bytes the device answered with (E6/E7/EC
+ * reports, register reads). The recording is only kept if every request
+ * of the init succeeded, each one fits in a single replay request, and the
+ * whole program fits in the program buffer.
+ */
+void ALPS::alps_submit(PS2Request *request) {
+    int count = request->commandsCount;
+    
+    _device->submitRequestAndBlock(request);
+    
+    if (!priv.init_recording) {
+        return;
+    }
+    
+    if (request->commandsCount != count ||
+        count > kMaxCommands ||
+        priv.init_count >= ALPS_INIT_REQUESTS ||
+        priv.init_length + count > ALPS_INIT_PROGRAM_SIZE) {
+        DEBUG_LOG("ALPS: Init will not be recorded\n");
+        priv.init_recording = false;
+        priv.init_count = 0;
+        return;
+    }
+    
+    memcpy(&priv.init_program[priv.init_length], request->commands, count * sizeof(PS2Command));
+    priv.init_sizes[priv.init_count++] = count;
+    priv.init_length += count;
+}
+
+/*
+ * Send the recorded init program, packing whole recorded requests into as
+ * few requests as possible. After each batch the acks and every byte read
+ * back are compared with the recording; a device that answers differently
+ * (EC reset, another mode) makes the caller fall back to the full init.
+ */
+bool ALPS::alps_replay_init() {
+    TPS2Request<> request;
+    int i = 0, pos = 0, start, cmdCount, k;
+    
+    while (i < priv.init_count) {
+        start = pos;
+        cmdCount = 0;
+        while (i < priv.init_count &&
+               cmdCount + priv.init_sizes[i] <= countof(request.commands)) {
+            memcpy(&request.commands[cmdCount], &priv.init_program[pos],
+                   priv.init_sizes[i] * sizeof(PS2Command));
+            cmdCount += priv.init_sizes[i];
+            pos += priv.init_sizes[i];
+            i++;
+        }
+        
+        if (!cmdCount) {
+            return false;
+        }
+        
+        request.commandsCount = cmdCount;
+        _device->submitRequestAndBlock(&request);
+        if (request.commandsCount != cmdCount) {
+            return false;
+        }
+        
+        for (k = 0; k < cmdCount; k++) {
+            PS2CommandEnum command = request.commands[k].command;
+            if ((command == kPS2C_ReadDataPort || command == kPS2C_ReadMouseDataPort) &&
+                request.commands[k].inOrOut != priv.init_program[start + k].inOrOut) {
+                IOLog("ALPS: Init replay read 0x%02x, expected 0x%02x\n",
+                      request.commands[k].inOrOut, priv.init_program[start + k].inOrOut);
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 /* Link with Base Driver */
@@ -245,8 +358,32 @@ bool ALPS::init(OSDictionary *dict) {
     return true;
 }
 
+bool ALPS::start(IOService *provider) {
+    if (!super::start(provider)) {
+        return false;
+    }
+    
+    IOWorkLoop *pWorkLoop = getWorkLoop();
+    idleTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ALPS::onIdleTimer));
+    if (pWorkLoop && idleTimer) {
+        pWorkLoop->addEventSource(idleTimer);
+    }
+    
+    return true;
+}
+
 void ALPS::stop(IOService *provider) {
     
+    IOWorkLoop *pWorkLoop = getWorkLoop();
+    if (idleTimer) {
+        cancelTimer(idleTimer);
+        if (pWorkLoop) {
+            pWorkLoop->removeEventSource(idleTimer);
+        }
+        idleTimer->release();
+        idleTimer = 0;
+    }
+    
     resetMouse();
     
     super::stop(provider);
@@ -266,7 +403,7 @@ bool ALPS::resetMouse() {
     request.commands[2].inOrOut = 0;
     request.commandsCount = 3;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     // Verify the result
     if (request.commands[1].inOrOut != kSC_Reset && request.commands[2].inOrOut != kSC_ID) {
@@ -287,7 +424,7 @@ void ALPS::alps_process_packet_v1_v2(UInt8 *packet) {
     int back = 0, forward = 0;
     uint64_t now_abs;
     
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     
     if (priv.proto_version == ALPS_PROTO_V1) {
         left = packet[2] & 0x10;
@@ -376,29 +513,36 @@ void ALPS::alps_process_packet_v1_v2(UInt8 *packet) {
     }
 }
 
+/*
+ * Each run of set bits in an electrode map is one contact. The first run
+ * is returned in low and the last one in high; runs in between are
+ * ignored, the same as the bit-by-bit walk in the Linux driver.
+ */
 static void alps_get_bitmap_points(unsigned int map,
                                    struct alps_bitmap_point *low,
                                    struct alps_bitmap_point *high,
                                    int *fingers)
 {
-    struct alps_bitmap_point *point;
-    int i, bit, prev_bit = 0;
-    
-    point = low;
-    for (i = 0; map != 0; i++, map >>= 1) {
-        bit = map & 1;
-        if (bit) {
-            if (!prev_bit) {
-                point->start_bit = i;
-                point->num_bits = 0;
-                (*fingers)++;
-            }
-            point->num_bits++;
-        } else {
-            if (prev_bit)
-                point = high;
-        }
-        prev_bit = bit;
+    unsigned int rest;
+    int runs, top;
+    
+    if (!map)
+        return;
+    
+    /* A run starts at every set bit whose lower neighbour is clear */
+    runs = __builtin_popcount(map & ~(map << 1));
+    *fingers += runs;
+    
+    low->start_bit = __builtin_ctz(map);
+    rest = ~(map >> low->start_bit);
+    low->num_bits = rest ? __builtin_ctz(rest) : 32 - low->start_bit;
+    
+    if (runs > 1) {
+        /* The last run ends at the top bit and starts above the highest gap */
+        top = 31 - __builtin_clz(map);
+        rest = ~map & ((1u << top) - 1);
+        high->start_bit = 32 - __builtin_clz(rest);
+        high->num_bits = top - high->start_bit + 1;
     }
 }
 
@@ -453,41 +597,27 @@ int ALPS::alps_process_bitmap(struct alps_data *priv,
         y_high.num_bits = max(i, 1);
     }
     
+    /*
+     * Corner coordinates come from the electrode tables built in
+     * alps_set_bitmap_tables(), indexed by 2 * start_bit + num_bits - 1
+     * (the centre of the contact in half-electrode units).
+     */
+    
     /* top-left corner */
-    corner[0].x = (priv->x_max * (2 * x_low.start_bit + x_low.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[0].y = (priv->y_max * (2 * y_low.start_bit + y_low.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[0].x = priv->x_bitmap_coord[2 * x_low.start_bit + x_low.num_bits - 1];
+    corner[0].y = priv->y_bitmap_coord[2 * y_low.start_bit + y_low.num_bits - 1];
     
     /* top-right corner */
-    corner[1].x = (priv->x_max * (2 * x_high.start_bit + x_high.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[1].y = (priv->y_max * (2 * y_low.start_bit + y_low.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[1].x = priv->x_bitmap_coord[2 * x_high.start_bit + x_high.num_bits - 1];
+    corner[1].y = priv->y_bitmap_coord[2 * y_low.start_bit + y_low.num_bits - 1];
     
     /* bottom-right corner */
-    corner[2].x = (priv->x_max * (2 * x_high.start_bit + x_high.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[2].y = (priv->y_max * (2 * y_high.start_bit + y_high.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
+    corner[2].x = priv->x_bitmap_coord[2 * x_high.start_bit + x_high.num_bits - 1];
+    corner[2].y = priv->y_bitmap_coord[2 * y_high.start_bit + y_high.num_bits - 1];
     
     /* bottom-left corner */
-    corner[3].x = (priv->x_max * (2 * x_low.start_bit + x_low.num_bits - 1)) /
-    (2 * (priv->x_bits - 1));
-    corner[3].y = (priv->y_max * (2 * y_high.start_bit + y_high.num_bits - 1)) /
-    (2 * (priv->y_bits - 1));
-    
-    /* x-bitmap order is reversed on v5 touchpads  */
-    if (priv->proto_version == ALPS_PROTO_V5) {
-        for (i = 0; i < 4; i++)
-            corner[i].x = priv->x_max - corner[i].x;
-    }
-    
-    /* y-bitmap order is reversed on v3 and v4 touchpads  */
-    if (priv->proto_version == ALPS_PROTO_V3 || priv->proto_version == ALPS_PROTO_V4) {
-        for (i = 0; i < 4; i++)
-            corner[i].y = priv->y_max - corner[i].y;
-    }
+    corner[3].x = priv->x_bitmap_coord[2 * x_low.start_bit + x_low.num_bits - 1];
+    corner[3].y = priv->y_bitmap_coord[2 * y_high.start_bit + y_high.num_bits - 1];
     
     /*
      * We only select a corner for the second touch once per 2 finger
@@ -536,6 +666,53 @@ int ALPS::alps_process_bitmap(struct alps_data *priv,
   return fingers;
 }
 
+/*
+ * Trackstick stage shared by the V3, V7 and SS4 protocols. x/y are the
+ * stick deltas with y pointing up, z the pressure on a 0-127 scale and
+ * divisor the protocol's own scale-down. The deltas are multiplied by a
+ * gain (1/256 units) that grows with deflection and with pressure above
+ * TrackstickPressureThreshold, capped at TrackstickAccelMax. What the
+ * division leaves over is kept for the next packet, so slow pushes that
+ * move less than one unit per packet still move the pointer. With the
+ * middle button held the stick scrolls, further divided by
+ * TrackstickScrollDivisor.
+ */
+void ALPS::alps_process_trackstick(int x, int y, int z, int divisor, UInt32 buttons, uint64_t now_abs) {
+    bool scrolling = buttons & 0x04;
+    int gain, dx, dy;
+    
+    /* Leftover motion does not carry between pointing and scrolling */
+    if (scrolling != trackstickscrolling) {
+        trackstickrestx = trackstickresty = 0;
+        trackstickscrolling = scrolling;
+    }
+    
+    gain = 256 + trackstickaccelspeed * (abs(x) + abs(y));
+    if (z > trackstickpressurethresh)
+        gain += trackstickaccelpressure * (z - trackstickpressurethresh);
+    if (trackstickaccelmax >= 256 && gain > trackstickaccelmax)
+        gain = trackstickaccelmax;
+    
+    if (scrolling && trackstickscrolldivisor > 1)
+        divisor *= trackstickscrolldivisor;
+    divisor <<= 8;
+    
+    /* Division truncates toward zero, so the remainder keeps the sign */
+    trackstickrestx += x * gain;
+    trackstickresty += y * gain;
+    dx = trackstickrestx / divisor;
+    dy = trackstickresty / divisor;
+    trackstickrestx -= dx * divisor;
+    trackstickresty -= dy * divisor;
+    
+    /* If middle button is pressed, switch to scroll mode. Else, move pointer normally */
+    if (!scrolling) {
+        dispatchRelativePointerEventX(dx, dy, buttons, now_abs);
+    } else {
+        dispatchScrollWheelEventX(-dy, -dx, 0, now_abs);
+    }
+}
+
 void ALPS::alps_process_trackstick_packet_v3(UInt8 *packet) {
     int x, y, z, left, right, middle;
     uint64_t now_abs;
@@ -568,18 +745,10 @@ void ALPS::alps_process_trackstick_packet_v3(UInt8 *packet) {
         x = y = 0;
     }
     
-    /*
-     * The x and y values tend to be quite large, and when used
-     * alone the trackstick is difficult to use. Scale them down
-     * to compensate.
-     */
-    x /= 3;
-    y /= 3;
-    
     /* To get proper movement direction */
     y = -y;
     
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     
     /*
      * Most ALPS models report the trackstick buttons in the touchpad
@@ -611,12 +780,12 @@ void ALPS::alps_process_trackstick_packet_v3(UInt8 *packet) {
         lastbuttons = buttons;
     }
     
-    /* If middle button is pressed, switch to scroll mode. Else, move pointer normally */
-    if (0 == (buttons & 0x04)) {
-        dispatchRelativePointerEventX(x, y, buttons, now_abs);
-    } else {
-        dispatchScrollWheelEventX(-y, -x, 0, now_abs);
-    }
+    /*
+     * The x and y values tend to be quite large, and when used
+     * alone the trackstick is difficult to use. Scale them down
+     * to compensate. Pressure is 5 bits here, 7 on V7 and SS4.
+     */
+    alps_process_trackstick(x, y, z << 2, 3, buttons, now_abs);
 }
 
 bool ALPS::alps_decode_buttons_v3(struct alps_fields *f, unsigned char *p) {
@@ -711,6 +880,7 @@ bool ALPS::alps_decode_dolphin(struct alps_fields *f, UInt8 *p) {
     return true;
 }
 
+template <decode_fields decode>
 void ALPS::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
     //ffff
     int fingers = 0, buttons = 0;
@@ -718,7 +888,7 @@ void ALPS::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
     
     memset(&f, 0, sizeof(f));
     
-    (this->*decode_fields)(&f, packet);
+    (this->*decode)(&f, packet);
     /*
      * There's no single feature of touchpad position and bitmap packets
      * that can be used to distinguish between them. We rely on the fact
@@ -738,7 +908,7 @@ void ALPS::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
              * Bitmap processing uses position packet's coordinate
              * data, so we need to do decode it first.
              */
-            (this->*decode_fields)(&f, priv.multi_data);
+            (this->*decode)(&f, priv.multi_data);
             if (alps_process_bitmap(&priv, &f) == 0) {
                 fingers = 0; /* Use st data */
             }
@@ -808,6 +978,7 @@ void ALPS::alps_process_touchpad_packet_v3_v5(UInt8 *packet) {
     dispatchEventsWithInfo(f.mt[0].x, f.mt[0].y, f.pressure, fingers, buttons);
 }
 
+template <decode_fields decode>
 void ALPS::alps_process_packet_v3(UInt8 *packet) {
     /*
      * v3 protocol packets come in three types, two representing
@@ -822,7 +993,7 @@ void ALPS::alps_process_packet_v3(UInt8 *packet) {
         return;
     }
     
-    alps_process_touchpad_packet_v3_v5(packet);
+    alps_process_touchpad_packet_v3_v5<decode>(packet);
 }
 
 void ALPS::alps_process_packet_v6(UInt8 *packet)
@@ -832,7 +1003,7 @@ void ALPS::alps_process_packet_v6(UInt8 *packet)
     int buttons = 0;
     
     uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     
     /*
      * We can use Byte5 to distinguish if the packet is from Touchpad
@@ -1009,6 +1180,108 @@ int ALPS::alps_get_mt_count(struct input_mt_pos *mt)
     return fingers;
 }
 
+/*
+ * The V7 and SS4 touchpads report contacts in slots, but a finger may move
+ * from one slot to another between packets. Follow the contacts across
+ * packets by matching each reported position to the nearest predicted
+ * position of a tracked contact, and reorder f->mt so that the oldest
+ * contact is always reported first and the others follow in age order.
+ * Positions that do not match any tracked contact within the gate start
+ * a new contact; tracked contacts that were not matched are dropped.
+ */
+void ALPS::alps_track_contacts(struct alps_fields *f)
+{
+    struct input_mt_pos pos[MAX_TOUCHES];
+    struct alps_contact next[MAX_TOUCHES];
+    struct alps_contact *c;
+    int match[MAX_TOUCHES];
+    bool taken[MAX_TOUCHES];
+    int count = 0, n = 0, kept, i, j, k;
+    int gate, best, bi, bj, dx, dy, d;
+    
+    if (f->fingers) {
+        for (i = 0; i < MAX_TOUCHES; i++) {
+            if (f->mt[i].x != 0 || f->mt[i].y != 0)
+                pos[count++] = f->mt[i];
+        }
+    }
+    
+    for (i = 0; i < MAX_TOUCHES; i++) {
+        match[i] = -1;
+        taken[i] = false;
+    }
+    
+    /* A finger cannot travel more than an eighth of the pad in one packet */
+    gate = (priv.x_max + priv.y_max) / 16;
+    gate *= gate;
+    
+    /* Greedy nearest-neighbour: pair off the closest position/contact first */
+    for (k = min(count, priv.num_contacts); k > 0; k--) {
+        best = gate;
+        bi = bj = -1;
+        for (i = 0; i < count; i++) {
+            if (match[i] >= 0)
+                continue;
+            for (j = 0; j < priv.num_contacts; j++) {
+                if (taken[j])
+                    continue;
+                c = &priv.contacts[j];
+                dx = (int)pos[i].x - (c->x + c->dx);
+                dy = (int)pos[i].y - (c->y + c->dy);
+                d = dx * dx + dy * dy;
+                if (d < best) {
+                    best = d;
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+        if (bi < 0)
+            break;
+        match[bi] = bj;
+        taken[bj] = true;
+    }
+    
+    /* Surviving contacts keep their age order... */
+    for (j = 0; j < priv.num_contacts; j++) {
+        if (!taken[j])
+            continue;
+        for (i = 0; match[i] != j; i++);
+        c = &priv.contacts[j];
+        next[n].id = c->id;
+        next[n].dx = ((int)pos[i].x - c->x + c->dx) / 2;
+        next[n].dy = ((int)pos[i].y - c->y + c->dy) / 2;
+        next[n].x = pos[i].x;
+        next[n].y = pos[i].y;
+        n++;
+    }
+    
+    kept = n;
+    
+    /* ...and new contacts are appended */
+    for (i = 0; i < count; i++) {
+        if (match[i] >= 0)
+            continue;
+        next[n].id = priv.next_contact_id++;
+        next[n].x = pos[i].x;
+        next[n].y = pos[i].y;
+        next[n].dx = next[n].dy = 0;
+        n++;
+    }
+    
+    priv.primary_changed = !n || !priv.num_contacts ||
+                           next[0].id != priv.contacts[0].id;
+    priv.contacts_changed = kept != n || kept != priv.num_contacts;
+    
+    memcpy(priv.contacts, next, n * sizeof(struct alps_contact));
+    priv.num_contacts = n;
+    
+    for (i = 0; i < MAX_TOUCHES; i++) {
+        f->mt[i].x = i < n ? next[i].x : 0;
+        f->mt[i].y = i < n ? next[i].y : 0;
+    }
+}
+
 bool ALPS::alps_decode_packet_v7(struct alps_fields *f, UInt8 *p){
     //IOLog("Decode V7 touchpad Packet... 0x%x 0x%x 0x%x 0x%x 0x%x 0x%x\n", p[0], p[1], p[2], p[3], p[4], p[5]);
     
@@ -1037,9 +1310,10 @@ bool ALPS::alps_decode_packet_v7(struct alps_fields *f, UInt8 *p){
      *    a possible jump of the x coordinate by 16 units when the first
      *    non NEW packet comes in
      * Since problems 2 & 3 cannot be worked around, just ignore them.
+     * alps_track_contacts() picks up any slot swap from the next packet.
      */
     if (pkt_id == V7_PACKET_ID_NEW)
-        return true;
+        return false;
     
     alps_get_finger_coordinate_v7(f->mt, p, pkt_id);
     
@@ -1075,7 +1349,7 @@ void ALPS::alps_process_trackstick_packet_v7(UInt8 *packet)
     int buttons = 0;
     
     uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
   
     /* It should be a DualPoint when received trackstick packet */
     if (!(priv.flags & ALPS_DUALPOINT)) {
@@ -1102,12 +1376,7 @@ void ALPS::alps_process_trackstick_packet_v7(UInt8 *packet)
     lastTrackStickButtons = buttons;
     buttons |= lastTouchpadButtons;
     
-    /* If middle button is pressed, switch to scroll mode. Else, move pointer normally */
-    if (0 == (buttons & 0x04)) {
-        dispatchRelativePointerEventX(x, y, buttons, now_abs);
-    } else {
-        dispatchScrollWheelEventX(-y, -x, 0, now_abs);
-    }
+    alps_process_trackstick(x, y, z, 1, buttons, now_abs);
 }
 
 void ALPS::alps_process_touchpad_packet_v7(UInt8 *packet){
@@ -1117,7 +1386,7 @@ void ALPS::alps_process_touchpad_packet_v7(UInt8 *packet){
     
     memset(&f, 0, sizeof(alps_fields));
     
-    if (!(this->*decode_fields)(&f, packet))
+    if (!alps_decode_packet_v7(&f, packet))
         return;
     
     buttons |= f.left ? 0x01 : 0;
@@ -1129,6 +1398,8 @@ void ALPS::alps_process_touchpad_packet_v7(UInt8 *packet){
     
     fingers = f.fingers;
     
+    alps_track_contacts(&f);
+    
     /* Reverse y co-ordinates to have 0 at bottom for gestures to work */
     f.mt[0].y = priv.y_max - f.mt[0].y;
     f.mt[1].y = priv.y_max - f.mt[1].y;
@@ -1189,7 +1460,7 @@ bool ALPS::alps_decode_ss4_v2(struct alps_fields *f, UInt8 *p){
     unsigned char pkt_id;
     unsigned int no_data_x, no_data_y;
     uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     
     pkt_id = alps_get_pkt_id_ss4_v2(p);
     
@@ -1304,10 +1575,10 @@ void ALPS::alps_process_packet_ss4_v2(UInt8 *packet) {
     int x, y, pressure;
     
     uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     
     memset(&f, 0, sizeof(struct alps_fields));
-    (this->*decode_fields)(&f, packet);
+    alps_decode_ss4_v2(&f, packet);
     if (priv.multi_packet) {
         /*
          * Sometimes the first packet will indicate a multi-packet
@@ -1317,7 +1588,7 @@ void ALPS::alps_process_packet_ss4_v2(UInt8 *packet) {
          */
         if (f.is_mp) {
             /* Now process the 1st packet */
-            (this->*decode_fields)(&f, priv.multi_data);
+            alps_decode_ss4_v2(&f, priv.multi_data);
         } else {
             priv.multi_packet = 0;
         }
@@ -1347,21 +1618,20 @@ void ALPS::alps_process_packet_ss4_v2(UInt8 *packet) {
             return;
         }
         
-        x = (((packet[0] & 1) << 7) | (packet[1] & 0x7f));
-        y = (((packet[3] & 1) << 7) | (packet[2] & 0x7f));
+        x = (SInt8) (((packet[0] & 1) << 7) | (packet[1] & 0x7f));
+        y = (SInt8) (((packet[3] & 1) << 7) | (packet[2] & 0x7f));
         pressure = (packet[4] & 0x7f);
         
         buttons |= f.ts_left ? 0x01 : 0;
         buttons |= f.ts_right ? 0x02 : 0;
         buttons |= f.ts_middle ? 0x04 : 0;
         
+        /* Prevent pointer jump on finger lift */
         if ((abs(x) >= 0x7f) || (abs(y) >= 0x7f)) {
-            return;
+            x = y = 0;
         }
         
-        //TODO: V8 Trackstick: Someone with the hardware needs to debug this.
-        //IOLog("ALPS: Trackstick report: X=%d, Y=%d, Z=%d, buttons=%d\n", x, y, pressure, buttons);
-        //dispatchRelativePointerEventX(x, y, 0, now_abs);
+        alps_process_trackstick(x, -y, pressure, 1, buttons, now_abs);
         return;
     }
     
@@ -1370,6 +1640,8 @@ void ALPS::alps_process_packet_ss4_v2(UInt8 *packet) {
     buttons |= f.right ? 0x02 : 0;
     buttons |= f.middle ? 0x04 : 0;
     
+    alps_track_contacts(&f);
+    
     /* Reverse y co-ordinates to have 0 at bottom for gestures to work */
     f.mt[0].y = priv.y_max - f.mt[0].y;
     f.mt[1].y = priv.y_max - f.mt[1].y;
@@ -1389,11 +1661,109 @@ void ALPS::setTouchPadEnable(bool enable) {
     if (enable) {
         initTouchPad();
     } else {
+        // no rate changes while the touchpad is off
+        if (idleTimer) {
+            cancelTimer(idleTimer);
+        }
+        idletimerarmed = false;
+        idlerate = false;
+        
         // to disable just reset the mouse
         resetMouse();
     }
 }
 
+/*
+ * Compile the framing rules of the detected protocol into one check per
+ * byte: the first byte must match byte0 under mask0, bytes 2 - pktsize of
+ * the V1-V4 protocols have 0 in the highest bit, V7 and SS4 have marker
+ * bits in bytes 3, 4 and 6 (alps_is_valid_package_v7/_ss4_v2), and on
+ * interleaved devices byte 4 must not look like a stuffed PS/2 packet.
+ * Called once the packet size, byte0/mask0 and flags are final.
+ */
+void ALPS::alps_set_byte_checks() {
+    struct alps_byte_check *check;
+    int i;
+    
+    for (i = 0; i < ALPS_MAX_PACKET_SIZE; i++) {
+        check = &priv.byte_check[i];
+        check->mask = check->value = 0;
+        check->reject_mask = 0;
+        check->reject_value = 0xff;
+        
+        if (i == 0) {
+            check->mask = priv.mask0;
+            check->value = priv.byte0;
+            continue;
+        }
+        
+        if (priv.proto_version < ALPS_PROTO_V5)
+            check->mask |= 0x80;
+    }
+    
+    switch (priv.proto_version) {
+        case ALPS_PROTO_V7:
+            priv.byte_check[2].mask |= 0x40;
+            priv.byte_check[2].value |= 0x40;
+            priv.byte_check[3].mask |= 0x48;
+            priv.byte_check[3].value |= 0x48;
+            priv.byte_check[5].mask |= 0x40;
+            break;
+            
+        case ALPS_PROTO_V8:
+            priv.byte_check[3].mask |= 0x08;
+            priv.byte_check[3].value |= 0x08;
+            priv.byte_check[5].mask |= 0x10;
+            break;
+    }
+    
+    /* PS/2 packet stuffed in the middle of ALPS packet */
+    if (priv.flags & ALPS_PS2_INTERLEAVED) {
+        priv.byte_check[3].reject_mask = 0x0f;
+        priv.byte_check[3].reject_value = 0x0f;
+    }
+    
+    /* V8's first byte can look like a bare PS/2 one, so never skip those */
+    priv.bare_mask = priv.proto_version == ALPS_PROTO_V8 ? 0 : 0xc8;
+}
+
+/*
+ * Check the byte just stored at packet[index] against the framing rules
+ * built by alps_set_byte_checks().
+ */
+inline bool ALPS::alps_is_valid_byte(UInt8 *packet, int index) {
+    const struct alps_byte_check *check = &priv.byte_check[index];
+    
+    return (packet[index] & check->mask) == check->value &&
+           (packet[index] & check->reject_mask) != check->reject_value;
+}
+
+/*
+ * The last byte stored broke framing. Instead of throwing the partial
+ * packet away, find the earliest offset from which the buffered bytes still
+ * form a valid packet prefix, move them to the front and carry on from
+ * there. Only the bytes in front of that offset are lost.
+ */
+void ALPS::alps_resync(UInt8 *packet) {
+    int count = _packetByteCount;
+    int offset, i;
+    
+    for (offset = 1; offset < count; offset++) {
+        for (i = 0; offset + i < count; i++) {
+            if (!alps_is_valid_byte(packet + offset, i))
+                break;
+        }
+        if (offset + i == count)
+            break;
+    }
+    
+    memmove(packet, packet + offset, count - offset);
+    _packetByteCount = count - offset;
+    
+    priv.stats.resyncs++;
+    priv.stats.dropped_bytes += offset;
+}
+
 PS2InterruptResult ALPS::interruptOccurred(UInt8 data) {
     //
     // This will be invoked automatically from our device when asynchronous
@@ -1402,197 +1772,230 @@ PS2InterruptResult ALPS::interruptOccurred(UInt8 data) {
     //
     
     UInt8 *packet = _ringBuffer.head();
-    
-    /* Save first packet */
-    if (0 == _packetByteCount) {
-        packet[0] = data;
-    }
-    
-    /* Reset PSMOUSE_BAD_DATA flag */
-    priv.PSMOUSE_BAD_DATA = false;
+    packet[_packetByteCount++] = data;
     
     /*
      * Check if we are dealing with a bare PS/2 packet, presumably from
      * a device connected to the external PS/2 port. Because bare PS/2
      * protocol does not have enough constant bits to self-synchronize
      * properly we only do this if the device is fully synchronized.
-     * Can not distinguish V8's first byte from PS/2 packet's
+     * Can not distinguish V8's first byte from PS/2 packet's, so its
+     * bare_mask is 0 and the test never matches.
+     * These packets are not reported, just counted and skipped.
      */
-    if (priv.proto_version != ALPS_PROTO_V8 &&
-        (packet[0] & 0xc8) == 0x08) {
-        if (_packetByteCount == 3) {
-            //dispatchRelativePointerEventWithPacket(packet, kPacketLengthSmall); //Dr Hurt: allow this?
-            priv.PSMOUSE_BAD_DATA = true;
-            _ringBuffer.advanceHead(priv.pktsize);
-            return kPS2IR_packetReady;
+    if ((packet[0] & priv.bare_mask) == 0x08) {
+        if (_packetByteCount == kPacketLengthSmall) {
+            priv.stats.dropped_bytes += kPacketLengthSmall;
+            _packetByteCount = 0;
         }
-        packet[_packetByteCount++] = data;
         return kPS2IR_packetBuffering;
     }
     
-    /* Check for PS/2 packet stuffed in the middle of ALPS packet. */
-    if ((priv.flags & ALPS_PS2_INTERLEAVED) &&
-        _packetByteCount >= 4 && (packet[3] & 0x0f) == 0x0f) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
-    }
-    
-    /* alps_is_valid_first_byte */
-    if ((packet[0] & priv.mask0) != priv.byte0) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
-    }
-    
-    /* Bytes 2 - pktsize should have 0 in the highest bit */
-    if (priv.proto_version < ALPS_PROTO_V5 &&
-        _packetByteCount >= 2 && _packetByteCount <= priv.pktsize &&
-        (packet[_packetByteCount - 1] & 0x80)) {
-        priv.PSMOUSE_BAD_DATA = true;
-        _ringBuffer.advanceHead(priv.pktsize);
-        return kPS2IR_packetReady;
+    if (!alps_is_valid_byte(packet, _packetByteCount - 1)) {
+        alps_resync(packet);
+        return kPS2IR_packetBuffering;
     }
     
-    /* alps_is_valid_package_v7 */
-    if (priv.proto_version == ALPS_PROTO_V7 &&
-        (((_packetByteCount == 3) && ((packet[2] & 0x40) != 0x40)) ||
-         ((_packetByteCount == 4) && ((packet[3] & 0x48) != 0x48)) ||
-         ((_packetByteCount == 6) && ((packet[5] & 0x40) != 0x0)))) {
-            priv.PSMOUSE_BAD_DATA = true;
-            _ringBuffer.advanceHead(priv.pktsize);
-            return kPS2IR_packetReady;
-        }
-    
-    /* alps_is_valid_package_ss4_v2 */
-    if (priv.proto_version == ALPS_PROTO_V8 &&
-        ((_packetByteCount == 4 && ((packet[3] & 0x08) != 0x08)) ||
-         (_packetByteCount == 6 && ((packet[5] & 0x10) != 0x0)))) {
-            priv.PSMOUSE_BAD_DATA = true;
-            _ringBuffer.advanceHead(priv.pktsize);
-            return kPS2IR_packetReady;
-        }
-    
-    packet[_packetByteCount++] = data;
-    if (_packetByteCount == priv.pktsize)
-    {
-        _ringBuffer.advanceHead(priv.pktsize);
+    if (_packetByteCount == priv.pktsize) {
+        // the arrival time travels with the packet, in the same ring slot
+        *(uint64_t*)(&packet[kPacketTimeOffset]) = getClock()->uptime();
+        _ringBuffer.advanceHead(kPacketLength);
+        _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
     return kPS2IR_packetBuffering;
 }
 
 void ALPS::packetReady() {
+    uint64_t now_abs;
+    
+    // when the work loop has fallen behind, sum up the queued motion
+    // instead of replaying it event by event
+    coalescing = coalescethreshold > 0 &&
+                 _ringBuffer.count() > (UInt32)(coalescethreshold * kPacketLength);
+    
     // empty the ring buffer, dispatching each packet...
-    while (_ringBuffer.count() >= priv.pktsize) {
+    while (_ringBuffer.count() >= kPacketLength) {
         UInt8 *packet = _ringBuffer.tail();
-        if (priv.PSMOUSE_BAD_DATA == false) {
-            (this->*process_packet)(packet);
-        } else {
-            IOLog("ALPS: an invalid or bare packet has been dropped...\n");
-            /* Might need to perform a full HW reset here if we keep receiving bad packets (consecutively) */
-        }
-        _packetByteCount = 0;
-        _ringBuffer.advanceTail(priv.pktsize);
+        _packetTime = *(uint64_t*)(&packet[kPacketTimeOffset]);
+        (this->*process_packet)(packet);
+        _ringBuffer.advanceTail(kPacketLength);
+    }
+    
+    if (coalescing) {
+        flushCoalescedEvents();
+        coalescing = false;
     }
+    
+    // the last packet's arrival time is recent enough for the idle timer
+    now_abs = _packetTime ? _packetTime : getClock()->uptime();
+    alps_note_activity(now_abs);
+#ifdef DEBUG
+    alps_update_stats(now_abs);
+#endif
 }
 
-bool ALPS::alps_command_mode_send_nibble(int nibble) {
+#ifdef DEBUG
+/*
+ * Debug builds only: log how often framing was lost, once a second.
+ */
+void ALPS::alps_update_stats(uint64_t now_abs) {
+    struct alps_packet_stats *stats = &priv.stats;
+    uint64_t elapsed_ns;
+    
+    if (!stats->window_start) {
+        stats->window_start = now_abs;
+        return;
+    }
+    
+    elapsed_ns = getClock()->toNanoseconds(now_abs - stats->window_start);
+    if (elapsed_ns < 1000000000ULL)
+        return;
+    
+    if (stats->resyncs || stats->dropped_bytes)
+        DEBUG_LOG("ALPS: proto 0x%x: %u resyncs, %u bytes dropped\n",
+                  priv.proto_version, stats->resyncs, stats->dropped_bytes);
+    
+    stats->resyncs = 0;
+    stats->dropped_bytes = 0;
+    stats->window_start = now_abs;
+}
+#endif
+
+/*
+ * Register accesses are built as one transaction: the address command and
+ * nibbles, the data nibbles and any read-back are appended to a single
+ * request, so an access costs one controller round-trip instead of one
+ * per nibble. The helpers below return the new command count, or -1 if
+ * the nibble encoding does not fit the protocol.
+ */
+int ALPS::alps_command_mode_add_nibble(PS2Command *commands, int cmdCount, int nibble) {
     SInt32 command;
-    // The largest amount of requests we will have is 2 right now
-    // 1 for the initial command, and 1 for sending data OR 1 for receiving data
-    // If the nibble commands at the top change then this will need to change as
-    // well. For now we will just validate that the request will not overload
-    // this object.
-    TPS2Request<2> request;
-    int cmdCount = 0, send = 0, receive = 0, i;
+    int send, receive, i;
     
     if (nibble > 0xf) {
         IOLog("%s::alps_command_mode_send_nibble ERROR: nibble value is greater than 0xf, command may fail\n", getName());
     }
     
-    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
     command = priv.nibble_commands[nibble].command;
-    request.commands[cmdCount++].inOrOut = command & 0xff;
-    
     send = (command >> 12 & 0xf);
     receive = (command >> 8 & 0xf);
     
+    // each nibble is the command, plus one byte sent OR one byte received
     if ((send > 1) || ((send + receive + 1) > 2)) {
-        return false;
+        return -1;
     }
     
+    commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmdCount++].inOrOut = command & 0xff;
+    
     if (send > 0) {
-        request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[cmdCount++].inOrOut = priv.nibble_commands[nibble].data;
+        commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+        commands[cmdCount++].inOrOut = priv.nibble_commands[nibble].data;
     }
     
     for (i = 0; i < receive; i++) {
-        request.commands[cmdCount].command = kPS2C_ReadDataPort;
-        request.commands[cmdCount++].inOrOut = 0;
+        commands[cmdCount].command = kPS2C_ReadDataPort;
+        commands[cmdCount++].inOrOut = 0;
+    }
+    
+    return cmdCount;
+}
+
+/*
+ * Append the address setup for addr, unless the touchpad is known to have
+ * that address set already (consecutive accesses to one register, e.g. a
+ * read followed by a write).
+ */
+int ALPS::alps_command_mode_add_addr(PS2Command *commands, int cmdCount, int addr) {
+    int i;
+    
+    if (addr == priv.cur_addr) {
+        return cmdCount;
+    }
+    
+    commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmdCount++].inOrOut = priv.addr_command;
+    
+    for (i = 12; i >= 0 && cmdCount >= 0; i -= 4) {
+        cmdCount = alps_command_mode_add_nibble(commands, cmdCount, (addr >> i) & 0xf);
+    }
+    
+    return cmdCount;
+}
+
+bool ALPS::alps_command_mode_send_nibble(int nibble) {
+    TPS2Request<2> request;
+    int cmdCount;
+    
+    priv.cur_addr = -1;
+    cmdCount = alps_command_mode_add_nibble(request.commands, 0, nibble);
+    if (cmdCount < 0) {
+        return false;
     }
     
     request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
-    
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     return request.commandsCount == cmdCount;
 }
 
 bool ALPS::alps_command_mode_set_addr(int addr) {
-    
-    TPS2Request<1> request;
-    int i, nibble;
+    TPS2Request<9> request;
+    int cmdCount;
     
     //    DEBUG_LOG("command mode set addr with addr command: 0x%02x\n", priv.addr_command);
-    request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut = priv.addr_command;
-    request.commandsCount = 1;
-    _device->submitRequestAndBlock(&request);
-    
-    if (request.commandsCount != 1) {
+    priv.cur_addr = -1;
+    cmdCount = alps_command_mode_add_addr(request.commands, 0, addr);
+    if (cmdCount < 0) {
         return false;
     }
     
-    for (i = 12; i >= 0; i -= 4) {
-        nibble = (addr >> i) & 0xf;
-        if (!alps_command_mode_send_nibble(nibble)) {
-            return false;
-        }
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
+    
+    if (request.commandsCount != cmdCount) {
+        return false;
     }
     
+    priv.cur_addr = addr;
     return true;
 }
 
 int ALPS::alps_command_mode_read_reg(int addr) {
-    TPS2Request<4> request;
+    TPS2Request<13> request;
     ALPSStatus_t status;
+    int cmdCount, result;
     
-    if (!alps_command_mode_set_addr(addr)) {
+    cmdCount = alps_command_mode_add_addr(request.commands, 0, addr);
+    if (cmdCount < 0) {
         DEBUG_LOG("Failed to set addr to read register\n");
         return -1;
     }
     
-    request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut = kDP_GetMouseInformation; //sync..
-    request.commands[1].command = kPS2C_ReadDataPort;
-    request.commands[1].inOrOut = 0;
-    request.commands[2].command = kPS2C_ReadDataPort;
-    request.commands[2].inOrOut = 0;
-    request.commands[3].command = kPS2C_ReadDataPort;
-    request.commands[3].inOrOut = 0;
-    request.commandsCount = 4;
+    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = kDP_GetMouseInformation; //sync..
+    result = cmdCount;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commands[cmdCount].command = kPS2C_ReadDataPort;
+    request.commands[cmdCount++].inOrOut = 0;
+    request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
-    if (request.commandsCount != 4) {
+    priv.cur_addr = -1;
+    if (request.commandsCount != cmdCount) {
         return -1;
     }
     
-    status.bytes[0] = request.commands[1].inOrOut;
-    status.bytes[1] = request.commands[2].inOrOut;
-    status.bytes[2] = request.commands[3].inOrOut;
+    status.bytes[0] = request.commands[result].inOrOut;
+    status.bytes[1] = request.commands[result + 1].inOrOut;
+    status.bytes[2] = request.commands[result + 2].inOrOut;
     
     //IOLog("ALPS read reg result: { 0x%02x, 0x%02x, 0x%02x }\n", status.bytes[0], status.bytes[1], status.bytes[2]);
     
@@ -1605,67 +2008,106 @@ int ALPS::alps_command_mode_read_reg(int addr) {
         return -1;
     }
     
+    priv.cur_addr = addr;
     return status.bytes[2];
 }
 
 bool ALPS::alps_command_mode_write_reg(int addr, UInt8 value) {
+    TPS2Request<13> request;
+    int cmdCount;
+    
+    cmdCount = alps_command_mode_add_addr(request.commands, 0, addr);
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_add_nibble(request.commands, cmdCount, (value >> 4) & 0xf);
+    }
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_add_nibble(request.commands, cmdCount, value & 0xf);
+    }
     
-    if (!alps_command_mode_set_addr(addr)) {
+    /* the address is not trusted after a write */
+    priv.cur_addr = -1;
+    if (cmdCount < 0) {
         return false;
     }
     
-    return alps_command_mode_write_reg(value);
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
+    
+    return request.commandsCount == cmdCount;
 }
 
 bool ALPS::alps_command_mode_write_reg(UInt8 value) {
-    if (!alps_command_mode_send_nibble((value >> 4) & 0xf)) {
-        return false;
+    TPS2Request<4> request;
+    int cmdCount;
+    
+    cmdCount = alps_command_mode_add_nibble(request.commands, 0, (value >> 4) & 0xf);
+    if (cmdCount >= 0) {
+        cmdCount = alps_command_mode_add_nibble(request.commands, cmdCount, value & 0xf);
     }
-    if (!alps_command_mode_send_nibble(value & 0xf)) {
+    
+    priv.cur_addr = -1;
+    if (cmdCount < 0) {
         return false;
     }
     
-    return true;
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
+    
+    return request.commandsCount == cmdCount;
 }
 
-bool ALPS::alps_rpt_cmd(SInt32 init_command, SInt32 init_arg, SInt32 repeated_command, ALPSStatus_t *report) {
-    TPS2Request<9> request;
-    int byte0, cmd;
-    cmd = byte0 = 0;
-    
+/*
+ * Append a report command (optional init command, three repeated commands
+ * and a status read) to a request. The report is read back from the last
+ * three commands. Returns the new command count.
+ */
+int ALPS::alps_add_rpt_cmd(PS2Command *commands, int cmd, SInt32 init_command, SInt32 init_arg, SInt32 repeated_command) {
     if (init_command) {
-        request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[cmd++].inOrOut = kDP_SetMouseResolution;
-        request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-        request.commands[cmd++].inOrOut = init_arg;
+        commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+        commands[cmd++].inOrOut = kDP_SetMouseResolution;
+        commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+        commands[cmd++].inOrOut = init_arg;
     }
     
-    
     // 3X run command
-    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = repeated_command;
-    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = repeated_command;
-    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = repeated_command;
+    commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmd++].inOrOut = repeated_command;
+    commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmd++].inOrOut = repeated_command;
+    commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmd++].inOrOut = repeated_command;
     
     // Get info/result
-    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[cmd++].inOrOut = kDP_GetMouseInformation;
-    byte0 = cmd;
-    request.commands[cmd].command = kPS2C_ReadDataPort;
-    request.commands[cmd++].inOrOut = 0;
-    request.commands[cmd].command = kPS2C_ReadDataPort;
-    request.commands[cmd++].inOrOut = 0;
-    request.commands[cmd].command = kPS2C_ReadDataPort;
-    request.commands[cmd++].inOrOut = 0;
+    commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    commands[cmd++].inOrOut = kDP_GetMouseInformation;
+    commands[cmd].command = kPS2C_ReadDataPort;
+    commands[cmd++].inOrOut = 0;
+    commands[cmd].command = kPS2C_ReadDataPort;
+    commands[cmd++].inOrOut = 0;
+    commands[cmd].command = kPS2C_ReadDataPort;
+    commands[cmd++].inOrOut = 0;
+    
+    return cmd;
+}
+
+static void alps_get_report(PS2Command *commands, int cmd, ALPSStatus_t *report) {
+    report->bytes[0] = commands[cmd - 3].inOrOut;
+    report->bytes[1] = commands[cmd - 2].inOrOut;
+    report->bytes[2] = commands[cmd - 1].inOrOut;
+}
+
+bool ALPS::alps_rpt_cmd(SInt32 init_command, SInt32 init_arg, SInt32 repeated_command, ALPSStatus_t *report) {
+    TPS2Request<9> request;
+    int cmd;
+    
+    cmd = alps_add_rpt_cmd(request.commands, 0, init_command, init_arg, repeated_command);
     request.commandsCount = cmd;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
-    report->bytes[0] = request.commands[byte0].inOrOut;
-    report->bytes[1] = request.commands[byte0+1].inOrOut;
-    report->bytes[2] = request.commands[byte0+2].inOrOut;
+    alps_get_report(request.commands, cmd, report);
     
     DEBUG_LOG("%02x report: [0x%02x 0x%02x 0x%02x]\n",
               repeated_command,
@@ -1681,6 +2123,8 @@ bool ALPS::alps_enter_command_mode() {
     TPS2Request<4> request;
     ALPSStatus_t status;
     
+    priv.cur_addr = -1;
+
     if (!alps_rpt_cmd(NULL, NULL, kDP_MouseResetWrap, &status)) {
         IOLog("ALPS: Failed to enter command mode!\n");
         return false;
@@ -1692,11 +2136,13 @@ bool ALPS::alps_exit_command_mode() {
     DEBUG_LOG("exit command mode\n");
     TPS2Request<1> request;
     
+    priv.cur_addr = -1;
+
     request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
     request.commands[0].inOrOut = kDP_SetMouseStreamMode;
     request.commandsCount = 1;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     return true;
 }
@@ -1715,7 +2161,7 @@ bool ALPS::alps_passthrough_mode_v2(bool enable) {
     request.commands[3].inOrOut = kDP_SetDefaultsAndDisable;
     request.commandsCount = 4;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     return request.commandsCount == 4;
 }
@@ -1778,7 +2224,7 @@ int ALPS::alps_monitor_mode(bool enable)
         request.commands[cmd++].inOrOut = 0;
         request.commandsCount = cmd;
         assert(request.commandsCount <= countof(request.commands));
-        _device->submitRequestAndBlock(&request);
+        alps_submit(&request);
         
         ps2_command_short(kDP_SetDefaultsAndDisable);
         ps2_command_short(kDP_SetDefaultsAndDisable);
@@ -1797,7 +2243,7 @@ int ALPS::alps_monitor_mode(bool enable)
         request.commands[cmd++].inOrOut = 0;
         request.commandsCount = cmd;
         assert(request.commandsCount <= countof(request.commands));
-        _device->submitRequestAndBlock(&request);
+        alps_submit(&request);
     } else {
         ps2_command_short(kDP_MouseResetWrap);
     }
@@ -1849,7 +2295,7 @@ bool ALPS::alps_tap_mode(bool enable) {
     request.commands[7].command = kPS2C_SendMouseCommandAndCompareAck;
     request.commands[7].inOrOut = tapArg;
     request.commandsCount = 8;
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     if (request.commandsCount != 8) {
         DEBUG_LOG("Enabling tap mode failed before getStatus call, command count=%d\n",
@@ -2020,7 +2466,7 @@ IOReturn ALPS::alps_setup_trackstick_v3(int regBase) {
         request.commands[2].inOrOut = kDP_SetMouseScaling1To1;
         request.commandsCount = 3;
         assert(request.commandsCount <= countof(request.commands));
-        _device->submitRequestAndBlock(&request);
+        alps_submit(&request);
         if (request.commandsCount != 3) {
             IOLog("ALPS: error sending magic E6 scaling sequence\n");
             ret = kIOReturnIOError;
@@ -2299,7 +2745,7 @@ void ALPS::alps_get_otp_values_ss4_v2(unsigned char index)
             request.commands[cmd++].inOrOut = 0;
             request.commandsCount = cmd;
             assert(request.commandsCount <= countof(request.commands));
-            _device->submitRequestAndBlock(&request);
+            alps_submit(&request);
             
             break;
             
@@ -2317,7 +2763,7 @@ void ALPS::alps_get_otp_values_ss4_v2(unsigned char index)
             request.commands[cmd++].inOrOut = 0;
             request.commandsCount = cmd;
             assert(request.commandsCount <= countof(request.commands));
-            _device->submitRequestAndBlock(&request);
+            alps_submit(&request);
             
             break;
     }
@@ -2355,7 +2801,7 @@ int ALPS::alps_dolphin_get_device_area(struct alps_data *priv)
     request.commands[cmd++].inOrOut = 0;
     request.commandsCount = cmd;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     /* results */
     status.bytes[0] = request.commands[1].inOrOut;
@@ -2450,7 +2896,7 @@ void ALPS::ps2_command(unsigned char value, UInt8 command)
     request.commands[cmdCount++].inOrOut = value;
     request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     //return request.commandsCount = cmdCount;
 }
@@ -2464,16 +2910,248 @@ void ALPS::ps2_command_short(UInt8 command)
     request.commands[cmdCount++].inOrOut = command;
     request.commandsCount = cmdCount;
     assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
+    alps_submit(&request);
     
     //return request.commandsCount = cmdCount;
 }
 
+/*
+ * Report rate. ReportRate (samples per second, 0 leaves the rate hw_init
+ * chose) is applied after every init. With IdleReportRate and IdleTimeout
+ * set as well, the touchpad drops to the idle rate once no packet has
+ * arrived for IdleTimeout, and goes back to ReportRate (or the PS/2 default
+ * rate, if ReportRate is 0) with the first packet after that. Reporting is
+ * stopped around the rate change so no packet bytes are mistaken for the
+ * command acks.
+ */
+bool ALPS::alps_set_report_rate(int rate)
+{
+    TPS2Request<4> request;
+    int cmdCount = 0;
+    
+    idlerate = false;
+    if (!rate) {
+        return true;
+    }
+    
+    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = kDP_SetDefaultsAndDisable;
+    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = kDP_SetMouseSampleRate;
+    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = rate;
+    request.commands[cmdCount].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmdCount++].inOrOut = kDP_Enable;
+    request.commandsCount = cmdCount;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
+    
+    if (request.commandsCount != cmdCount) {
+        IOLog("ALPS: Failed to set report rate to %d\n", rate);
+        return false;
+    }
+    
+    DEBUG_LOG("ALPS: Report rate set to %d\n", rate);
+    return true;
+}
+
+void ALPS::alps_set_report_rate_async(int rate)
+{
+    //
+    // Called from the work loop, so the request must not block.
+    //
+    
+    PS2Request *request = _device->allocateRequest(4);
+    if (!request) {
+        return;
+    }
+    
+    request->commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
+    request->commands[0].inOrOut = kDP_SetDefaultsAndDisable;
+    request->commands[1].command = kPS2C_SendMouseCommandAndCompareAck;
+    request->commands[1].inOrOut = kDP_SetMouseSampleRate;
+    request->commands[2].command = kPS2C_SendMouseCommandAndCompareAck;
+    request->commands[2].inOrOut = rate;
+    request->commands[3].command = kPS2C_SendMouseCommandAndCompareAck;
+    request->commands[3].inOrOut = kDP_Enable;
+    request->commandsCount = 4;
+    request->completionTarget = this;
+    request->completionAction = OSMemberFunctionCast(PS2CompletionAction, this, &ALPS::alps_set_report_rate_done);
+    request->completionParam = request;
+    _device->submitRequest(request);
+    
+    DEBUG_LOG("ALPS: Report rate switching to %d\n", rate);
+}
+
+void ALPS::alps_set_report_rate_done(void *param)
+{
+    PS2Request *request = (PS2Request *)param;
+    int count = request->commandsCount;
+    
+    _device->freeRequest(request);
+    
+    if (count == 4) {
+        return;
+    }
+    
+    // the sequence stopped after F5 left reporting off, turn it back on
+    IOLog("ALPS: Report rate change failed at command %d, re-enabling\n", count);
+    if (!streamoff) {
+        streamretries = 2;
+        alps_set_stream_async(false);
+    }
+}
+
+void ALPS::alps_note_activity(uint64_t now_abs)
+{
+    if (!idlereportrate || !idletimeout || !idleTimer) {
+        return;
+    }
+    
+    lastactivity = now_abs;
+    
+    if (idlerate) {
+        idlerate = false;
+        alps_set_report_rate_async(reportrate ? reportrate : ALPS_DEFAULT_RATE);
+    }
+    
+    if (!idletimerarmed) {
+        idletimerarmed = true;
+        setTimerTimeout(idleTimer, idletimeout);
+    }
+}
+
+void ALPS::onIdleTimer()
+{
+    uint64_t now_abs, idle_ns;
+    
+    now_abs = getClock()->uptime();
+    idle_ns = getClock()->toNanoseconds(now_abs - lastactivity);
+    
+    if (idle_ns < idletimeout) {
+        // there was activity since the timer was set, check again later
+        setTimerTimeout(idleTimer, idletimeout - idle_ns);
+        return;
+    }
+    
+    idletimerarmed = false;
+    // the rate change ends with F4, which would restart a stopped stream
+    if (!idlerate && idlereportrate && !streamoff) {
+        idlerate = true;
+        alps_set_report_rate_async(idlereportrate);
+    }
+}
+
+/*
+ * The keyboard (kPS2M_setDisableTouchpad) or a USB mouse (mousecount) has
+ * changed ignoreall. Rather than decoding and dropping every packet while
+ * the touchpad is off, stop reporting at the device so it raises no
+ * interrupts at all, and start it again on re-enable. DualPoint devices
+ * send trackstick packets through the same stream, so they keep streaming
+ * and dispatchEventsWithInfo drops the touchpad data as before.
+ */
+void ALPS::touchpadToggled()
+{
+    bool off = ignoreall && !(priv.flags & ALPS_DUALPOINT);
+    
+    if (off == streamoff) {
+        return;
+    }
+    
+    if (off) {
+        if (idleTimer) {
+            cancelTimer(idleTimer);
+        }
+        idletimerarmed = false;
+    }
+    
+    streamretries = 2;
+    alps_set_stream_async(off);
+}
+
+/*
+ * Stop (F5) or start (F4) the device's data stream. This may come from the
+ * keyboard driver's message path, so the request must not block; streamoff
+ * only follows once the device has acked the command.
+ */
+void ALPS::alps_set_stream_async(bool off)
+{
+    PS2Request *request = _device->allocateRequest(1);
+    if (!request) {
+        IOLog("ALPS: Unable to %s the touchpad data stream\n", off ? "stop" : "start");
+        return;
+    }
+    
+    request->commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
+    request->commands[0].inOrOut = off ? kDP_SetDefaultsAndDisable : kDP_Enable;
+    request->commandsCount = 1;
+    request->completionTarget = this;
+    request->completionAction = OSMemberFunctionCast(PS2CompletionAction, this, &ALPS::alps_set_stream_done);
+    request->completionParam = request;
+    _device->submitRequest(request);
+}
+
+void ALPS::alps_set_stream_done(void *param)
+{
+    PS2Request *request = (PS2Request *)param;
+    bool off = request->commands[0].inOrOut == kDP_SetDefaultsAndDisable;
+    bool acked = request->commandsCount == 1;
+    
+    _device->freeRequest(request);
+    
+    if (acked) {
+        streamoff = off;
+        DEBUG_LOG("ALPS: Touchpad data stream %s\n", off ? "stopped" : "started");
+        return;
+    }
+    
+    IOLog("ALPS: Touchpad data stream %s was not acked%s\n", off ? "stop" : "start",
+          streamretries > 0 ? ", retrying" : "");
+    if (streamretries-- > 0) {
+        alps_set_stream_async(off);
+    }
+}
+
+/*
+ * Precompute the electrode -> coordinate tables used by alps_process_bitmap().
+ * Entry i holds the coordinate of a contact whose centre lies at i/2
+ * electrodes, with the per-protocol axis reversal already applied.
+ */
+void ALPS::alps_set_bitmap_tables() {
+    int i;
+    
+    memset(priv.x_bitmap_coord, 0, sizeof(priv.x_bitmap_coord));
+    memset(priv.y_bitmap_coord, 0, sizeof(priv.y_bitmap_coord));
+    
+    if (priv.x_bits < 2 || priv.y_bits < 2)
+        return;
+    
+    for (i = 0; i < ALPS_BITMAP_COORDS; i++) {
+        priv.x_bitmap_coord[i] = (priv.x_max * i) / (2 * (priv.x_bits - 1));
+        priv.y_bitmap_coord[i] = (priv.y_max * i) / (2 * (priv.y_bits - 1));
+        
+        /* x-bitmap order is reversed on v5 touchpads  */
+        if (priv.proto_version == ALPS_PROTO_V5)
+            priv.x_bitmap_coord[i] = priv.x_max - priv.x_bitmap_coord[i];
+        
+        /* y-bitmap order is reversed on v3 and v4 touchpads  */
+        if (priv.proto_version == ALPS_PROTO_V3 || priv.proto_version == ALPS_PROTO_V4)
+            priv.y_bitmap_coord[i] = priv.y_max - priv.y_bitmap_coord[i];
+    }
+}
+
 void ALPS::set_protocol() {
     priv.byte0 = 0x8f;
     priv.mask0 = 0x8f;
     priv.flags = ALPS_DUALPOINT;
     
+    priv.num_contacts = 0;
+    priv.next_contact_id = 0;
+    priv.primary_changed = true;
+    priv.cur_addr = -1;
+    
+    memset(&priv.stats, 0, sizeof(priv.stats));
+    
     priv.x_max = 2000;
     priv.y_max = 1400;
     priv.x_bits = 15;
@@ -2491,9 +3169,8 @@ void ALPS::set_protocol() {
             
         case ALPS_PROTO_V3:
             hw_init = &ALPS::alps_hw_init_v3;
-            process_packet = &ALPS::alps_process_packet_v3;
+            process_packet = &ALPS::alps_process_packet_v3<&ALPS::alps_decode_pinnacle>;
             //            set_abs_params = alps_set_abs_params_mt;
-            decode_fields = &ALPS::alps_decode_pinnacle;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             
@@ -2507,9 +3184,8 @@ void ALPS::set_protocol() {
             
         case ALPS_PROTO_V3_RUSHMORE:
             hw_init = &ALPS::alps_hw_init_rushmore_v3;
-            process_packet = &ALPS::alps_process_packet_v3;
+            process_packet = &ALPS::alps_process_packet_v3<&ALPS::alps_decode_rushmore>;
             //            set_abs_params = alps_set_abs_params_mt;
-            decode_fields = &ALPS::alps_decode_rushmore;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             priv.x_bits = 16;
@@ -2533,8 +3209,7 @@ void ALPS::set_protocol() {
             
         case ALPS_PROTO_V5:
             hw_init = &ALPS::alps_hw_init_dolphin_v1;
-            process_packet = &ALPS::alps_process_touchpad_packet_v3_v5;
-            decode_fields = &ALPS::alps_decode_dolphin;
+            process_packet = &ALPS::alps_process_touchpad_packet_v3_v5<&ALPS::alps_decode_dolphin>;
             //            set_abs_params = alps_set_abs_params_mt;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
@@ -2566,7 +3241,6 @@ void ALPS::set_protocol() {
         case ALPS_PROTO_V7:
             hw_init = &ALPS::alps_hw_init_v7;
             process_packet = &ALPS::alps_process_packet_v7;
-            decode_fields = &ALPS::alps_decode_packet_v7;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             priv.byte0 = 0x48;
@@ -2591,7 +3265,6 @@ void ALPS::set_protocol() {
         case ALPS_PROTO_V8:
             hw_init = &ALPS::alps_hw_init_ss4_v2;
             process_packet = &ALPS::alps_process_packet_ss4_v2;
-            decode_fields = &ALPS::alps_decode_ss4_v2;
             priv.nibble_commands = alps_v3_nibble_commands;
             priv.addr_command = kDP_MouseResetWrap;
             priv.byte0 = 0x18;
@@ -2607,7 +3280,7 @@ void ALPS::set_protocol() {
                 priv.y_max = 4080;
                 priv.flags |= ALPS_DUALPOINT |
                 ALPS_DUALPOINT_WITH_PRESSURE;
-                IOLog("ALPS: TrackStick detected... (WARNING: V8 TrackStick disabled)\n");
+                IOLog("ALPS: TrackStick detected...\n");
             } else {
                 // buttonless
                 priv.x_max = 8176;
@@ -2617,6 +3290,9 @@ void ALPS::set_protocol() {
             }
             break;
     }
+    
+    alps_set_bitmap_tables();
+    alps_update_transform();
 }
 
 bool ALPS::matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec) {
@@ -2660,37 +3336,114 @@ bool ALPS::matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec) {
     return false;
 }
 
-IOReturn ALPS::identify() {
-    ALPSStatus_t e6, e7, ec;
+/*
+ * Read the E6, E7 and EC reports and leave command mode again, all in a
+ * single request. If the touchpad rejects any step, fall back to sending
+ * each report on its own so the failing one can be told apart.
+ */
+bool ALPS::alps_read_identity(ALPSStatus_t *e6, ALPSStatus_t *e7, ALPSStatus_t *ec) {
+    TPS2Request<28> request;
+    int cmd = 0, e6_end, e7_end, ec_end;
     
-    /*
-     * First try "E6 report".
-     * ALPS should return 0,0,10 or 0,0,100 if no buttons are pressed.
-     * The bits 0-2 of the first byte will be 1s if some buttons are
-     * pressed.
-     */
+    cmd = e6_end = alps_add_rpt_cmd(request.commands, cmd, kDP_SetMouseResolution, NULL, kDP_SetMouseScaling1To1);
+    cmd = e7_end = alps_add_rpt_cmd(request.commands, cmd, kDP_SetMouseResolution, NULL, kDP_SetMouseScaling2To1);
+    cmd = ec_end = alps_add_rpt_cmd(request.commands, cmd, kDP_SetMouseResolution, NULL, kDP_MouseResetWrap);
+    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmd++].inOrOut = kDP_SetMouseStreamMode;
+    request.commandsCount = cmd;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
     
-    if (!alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_SetMouseScaling1To1, &e6)) {
-        IOLog("ALPS: identify: not an ALPS device. Error getting E6 report\n");
-        //return kIOReturnIOError;
+    if (request.commandsCount == cmd) {
+        alps_get_report(request.commands, e6_end, e6);
+        alps_get_report(request.commands, e7_end, e7);
+        alps_get_report(request.commands, ec_end, ec);
+        DEBUG_LOG("ALPS: identify: E6=0x%02x 0x%02x 0x%02x\n", e6->bytes[0], e6->bytes[1], e6->bytes[2]);
+    } else {
+        DEBUG_LOG("ALPS: identify: combined request failed at %d, retrying step by step\n", request.commandsCount);
+        
+        /*
+         * First try "E6 report".
+         * ALPS should return 0,0,10 or 0,0,100 if no buttons are pressed.
+         * The bits 0-2 of the first byte will be 1s if some buttons are
+         * pressed.
+         */
+        if (!alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_SetMouseScaling1To1, e6)) {
+            IOLog("ALPS: identify: not an ALPS device. Error getting E6 report\n");
+        }
+        
+        /*
+         * Now get the "E7" and "EC" reports.  These will uniquely identify
+         * most ALPS touchpads.
+         */
+        if (!(alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_SetMouseScaling2To1, e7) &&
+              alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_MouseResetWrap, ec) &&
+              alps_exit_command_mode())) {
+            IOLog("ALPS: identify: not an ALPS device. Error getting E7/EC report\n");
+            return false;
+        }
     }
     
-    if ((e6.bytes[0] & 0xf8) != 0 || e6.bytes[1] != 0 || (e6.bytes[2] != 10 && e6.bytes[2] != 100)) {
+    if ((e6->bytes[0] & 0xf8) != 0 || e6->bytes[1] != 0 || (e6->bytes[2] != 10 && e6->bytes[2] != 100)) {
         IOLog("ALPS: identify: not an ALPS device. Invalid E6 report\n");
-        //return kIOReturnInvalid;
     }
     
-    /*
-     * Now get the "E7" and "EC" reports.  These will uniquely identify
-     * most ALPS touchpads.
-     */
-    if (!(alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_SetMouseScaling2To1, &e7) &&
-          alps_rpt_cmd(kDP_SetMouseResolution, NULL, kDP_MouseResetWrap, &ec) &&
-          alps_exit_command_mode())) {
-        IOLog("ALPS: identify: not an ALPS device. Error getting E7/EC report\n");
+    return true;
+}
+
+/*
+ * If the platform profile carries the identity of this machine's touchpad
+ * (ALPSIdentity: the E7 and EC reports), a single EC report is enough to
+ * confirm it is still the same device.
+ */
+bool ALPS::alps_confirm_identity(ALPSStatus_t *e7, ALPSStatus_t *ec) {
+    TPS2Request<10> request;
+    int cmd;
+    
+    if (!priv.id_cached) {
+        return false;
+    }
+    
+    cmd = alps_add_rpt_cmd(request.commands, 0, kDP_SetMouseResolution, NULL, kDP_MouseResetWrap);
+    request.commands[cmd].command = kPS2C_SendMouseCommandAndCompareAck;
+    request.commands[cmd++].inOrOut = kDP_SetMouseStreamMode;
+    request.commandsCount = cmd;
+    assert(request.commandsCount <= countof(request.commands));
+    alps_submit(&request);
+    
+    if (request.commandsCount != cmd) {
+        return false;
+    }
+    
+    alps_get_report(request.commands, cmd - 1, ec);
+    if (memcmp(ec->bytes, priv.id_ec, sizeof(ec->bytes))) {
+        IOLog("ALPS: identify: touchpad does not match ALPSIdentity, running full identification\n");
+        return false;
+    }
+    
+    memcpy(e7->bytes, priv.id_e7, sizeof(e7->bytes));
+    return true;
+}
+
+IOReturn ALPS::identify() {
+    ALPSStatus_t e6, e7, ec;
+    UInt8 identity[6];
+    
+    if (alps_confirm_identity(&e7, &ec)) {
+        DEBUG_LOG("ALPS: identify: confirmed from ALPSIdentity\n");
+    } else if (!alps_read_identity(&e6, &e7, &ec)) {
         return kIOReturnIOError;
     }
     
+    // publish the reports so they can be copied into the platform profile
+    memcpy(identity, e7.bytes, 3);
+    memcpy(identity + 3, ec.bytes, 3);
+    OSData *data = OSData::withBytes(identity, sizeof(identity));
+    if (data) {
+        setProperty("ALPSIdentity", data);
+        data->release();
+    }
+    
     if (matchTable(&e7, &ec)) {
         return 0;
         
@@ -2741,467 +3494,117 @@ IOReturn ALPS::identify() {
 /* ===========================||\\PROCESS AND DISPATCH TO macOS//||============================== */
 /* ============================================================================================== */
 
-void ALPS::dispatchEventsWithInfo(int xraw, int yraw, int z, int fingers, UInt32 buttonsraw) {
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
-    uint64_t now_ns;
-    absolutetime_to_nanoseconds(now_abs, &now_ns);
-    
-    // scale x & y to the axis which has the most resolution
-    if (xupmm < yupmm) {
-        xraw = xraw * yupmm / xupmm;
-    } else if (xupmm > yupmm) {
-        yraw = yraw * xupmm / yupmm;
-    }
-    
-    /* Dr Hurt: Scale all touchpads' axes to 6000 to be able to the same divisors for all models */
-    xraw *= (6000 / ((priv.x_max + priv.y_max)/2));
-    yraw *= (6000 / ((priv.x_max + priv.y_max)/2));
-    
-    int x = xraw;
-    int y = yraw;
-    
-    fingers = z > z_finger ? fingers : 0;
-    
-    // allow middle click to be simulated the other two physical buttons
-    UInt32 buttons = buttonsraw;
-    lastbuttons = buttons;
-    
-    // allow middle button to be simulated with two buttons down
-    if (!clickpadtype || fingers == 3) {
-        buttons = middleButton(buttons, now_abs, fingers == 3 ? fromPassthru : fromTrackpad);
-        DEBUG_LOG("New buttons value after check for middle click: %d\n", buttons);
-    }
-    
-    // recalc middle buttons if finger is going down
-    if (0 == last_fingers && fingers > 0) {
-        buttons = middleButton(buttonsraw | passbuttons, now_abs, fromCancel);
-    }
-    
-    if (last_fingers > 0 && fingers > 0 && last_fingers != fingers) {
-        // ignore deltas for a while after finger change
-        ignoredeltas = ignoredeltasstart;
-    }
-    
-    if (last_fingers != fingers) {
-        DEBUG_LOG("Finger change, reset averages\n");
-        // reset averages after finger change
-        x_undo.reset();
-        y_undo.reset();
-        x_avg.reset();
-        y_avg.reset();
-    }
-    
-    // unsmooth input (probably just for testing)
-    // by default the trackpad itself does a simple decaying average (1/2 each)
-    // we can undo it here
-    if (unsmoothinput) {
-        x = x_undo.filter(x);
-        y = y_undo.filter(y);
-    }
-    
-    // smooth input by unweighted average
-    if (smoothinput) {
-        x = x_avg.filter(x);
-        y = y_avg.filter(y);
-    }
-    
-    if (ignoredeltas) {
-        DEBUG_LOG("ALPS: Still ignoring deltas. Value=%d\n", ignoredeltas);
-        lastx = x;
-        lasty = y;
-        if (--ignoredeltas == 0) {
-            x_undo.reset();
-            y_undo.reset();
-            x_avg.reset();
-            y_avg.reset();
-        }
+/*
+ * Build the per-device transform from raw coordinates to the 6000 unit
+ * space the gesture thresholds and divisors are written for: both axes
+ * are scaled by 6000 over the mean axis range, the axis with fewer units
+ * per mm is stretched to match the other (UnitsPerMMX/Y), then SwapXY,
+ * FlipX and FlipY orient the result. Everything is folded into one Q16
+ * affine matrix so that a packet costs multiplies and shifts only; the
+ * pointer divisors are applied the same way in recognizeGesture. Called
+ * whenever the axis ranges or the configuration change.
+ *
+ * The scale is the whole number the old per-packet divide path used, so
+ * pointer speed on existing pads does not change. Only pads whose mean
+ * range is above 6000 (SS4), where that number is 0 and the pointer did
+ * not move, get the exact ratio instead.
+ */
+void ALPS::alps_update_transform() {
+    SInt64 range, scale, sx, sy, xextent, yextent;
+    int xu = xupmm > 0 ? xupmm : 1;
+    int yu = yupmm > 0 ? yupmm : 1;
+    
+    range = (priv.x_max + priv.y_max) / 2;
+    if (range <= 0)
+        range = 1;
+    
+    scale = 6000 / range;
+    sx = sy = scale ? scale << 16 : ((SInt64) 6000 << 16) / range;
+    /* rounded up, so the stretch never comes out below the divide path */
+    if (xu < yu)
+        sx = (sx * yu + xu - 1) / xu;
+    else if (xu > yu)
+        sy = (sy * xu + yu - 1) / yu;
+    
+    memset(transform, 0, sizeof(transform));
+    if (swapxy) {
+        transform[0][1] = sy;
+        transform[1][0] = sx;
+        xextent = sy * priv.y_max;
+        yextent = sx * priv.x_max;
+    } else {
+        transform[0][0] = sx;
+        transform[1][1] = sy;
+        xextent = sx * priv.x_max;
+        yextent = sy * priv.y_max;
     }
-    
-    // deal with "OutsidezoneNoAction When Typing"
-    if (outzone_wt && z > z_finger && now_ns - keytime < maxaftertyping &&
-        (x < zonel || x > zoner || y < zoneb || y > zonet)) {
-        DEBUG_LOG("Ignore touch input after typing\n");
-        // touch input was shortly after typing and outside the "zone"
-        // ignore it...
-        return;
+    if (flipx) {
+        transform[0][0] = -transform[0][0];
+        transform[0][1] = -transform[0][1];
+        transform[0][2] = xextent;
     }
-    
-    // if trackpad input is supposed to be ignored, then don't do anything
-    if (ignoreall) {
-        DEBUG_LOG("ignoreall is set, returning\n");
-        return;
+    if (flipy) {
+        transform[1][0] = -transform[1][0];
+        transform[1][1] = -transform[1][1];
+        transform[1][2] = yextent;
     }
     
 #ifdef DEBUG
-    int tm1 = touchmode;
-#endif
-    DEBUG_LOG("VoodooPS2::Mode: %d\n", touchmode);
-    if (z < z_finger && isTouchMode()) {
-        // Finger has been lifted
-        DEBUG_LOG("finger lifted after touch\n");
-        xrest = yrest = scrollrest = 0;
-        inSwipeLeft = inSwipeRight = inSwipeUp = inSwipeDown = 0;
-        inSwipe4Left = inSwipe4Right = inSwipe4Up = inSwipe4Down = 0;
-        xmoved = ymoved = 0;
-        untouchtime = now_ns;
-        
-        DEBUG_LOG("finger lifted -> touchmode: %d history: %d", touchmode, dy_history.count());
-        DEBUG_LOG("PS2: wastriple: %d wasdouble: %d touchtime: %llu", wastriple, wasdouble, touchtime);
-        
-        // check for scroll momentum start
-        if ((MODE_MTOUCH == touchmode || MODE_VSCROLL == touchmode) && momentumscroll && momentumscrolltimer) {
-            // releasing when we were in touchmode -- check for momentum scroll
-            if (dy_history.count() > momentumscrollsamplesmin &&
-                (momentumscrollinterval = time_history.newest() - time_history.oldest())) {
-                momentumscrollsum = dy_history.sum();
-                momentumscrollcurrent = momentumscrolltimer * momentumscrollsum;
-                momentumscrollrest1 = 0;
-                momentumscrollrest2 = 0;
-                setTimerTimeout(scrollTimer, momentumscrolltimer);
-            }
-        }
-        time_history.reset();
-        dy_history.reset();
-        
-        if (now_ns - touchtime < maxtaptime && clicking) {
-            switch (touchmode) {
-                case MODE_DRAG:
-                    if (!immediateclick) {
-                        buttons &= ~0x7;
-                        dispatchRelativePointerEventX(0, 0, buttons | 0x1, now_abs);
-                        dispatchRelativePointerEventX(0, 0, buttons, now_abs);
-                    }
-                    if (wastriple && rtap) {
-                        buttons |= !swapdoubletriple ? 0x4 : 0x02;
-                    } else if (wasdouble && rtap) {
-                        buttons |= !swapdoubletriple ? 0x2 : 0x04;
-                    } else {
-                        buttons |= 0x1;
-                    }
-                    touchmode = MODE_NOTOUCH;
-                    break;
-                    
-                case MODE_DRAGLOCK:
-                    touchmode = MODE_NOTOUCH;
-                    break;
-                    
-                default: //dispatch taps
-                    if (wastriple && rtap)
-                    {
-                        buttons |= !swapdoubletriple ? 0x4 : 0x02;
-                        touchmode=MODE_NOTOUCH;
-                    }
-                    else if (wasdouble && rtap)
-                    {
-                        buttons |= !swapdoubletriple ? 0x2 : 0x04;
-                        touchmode=MODE_NOTOUCH;
-                    }
-                    else
-                    {
-                        buttons |= 0x1;
-                        touchmode=dragging ? MODE_PREDRAG : MODE_NOTOUCH;
-                    }
-                    break;
-            }
-        }
-        else {
-            if ((touchmode==MODE_DRAG || touchmode==MODE_DRAGLOCK)
-                && (draglock || draglocktemp || (dragTimer && dragexitdelay)))
-            {
-                touchmode=MODE_DRAGNOTOUCH;
-                if (!draglock && !draglocktemp)
-                {
-                    cancelTimer(dragTimer);
-                    setTimerTimeout(dragTimer, dragexitdelay);
-                }
-            } else {
-                touchmode = MODE_NOTOUCH;
-                draglocktemp = 0;
-            }
-        }
-        wasdouble = false;
-        wastriple = false;
-    }
-    
-    // cancel pre-drag mode if second tap takes too long
-    if (touchmode == MODE_PREDRAG && now_ns - untouchtime >= maxdragtime) {
-        DEBUG_LOG("cancel pre-drag since second tap took too long\n");
-        touchmode = MODE_NOTOUCH;
-    }
-    
-    // Note: This test should probably be done somewhere else, especially if to
-    // implement more gestures in the future, because this information we are
-    // erasing here (time of touch) might be useful for certain gestures...
-    
-    // cancel tap if touch point moves too far
-    if (isTouchMode() && isFingerTouch(z) && last_fingers == fingers) {
-        int dy = abs(touchy-y);
-        int dx = abs(touchx-x);
-        DEBUG_LOG("PS2: Cancel DX: %d Cancel DY: %d", dx, dy);
-        if (!wasdouble && !wastriple && (dx > tapthreshx || dy > tapthreshy)) {
-            touchtime = 0;
-        }
-        else if (dx > dblthreshx || dy > dblthreshy) {
-            touchtime = 0;
+    /*
+     * Sweep the coordinate range against the divide path this replaced.
+     * It stretched before scaling, so with unequal UnitsPerMMX/Y the
+     * stretched axis may come out up to scale units higher; otherwise
+     * the two agree exactly.
+     */
+    if (scale && !swapxy && !flipx && !flipy) {
+        int raw, xold, yold, xnew, ynew, mismatches = 0;
+        for (raw = 0; raw <= max(priv.x_max, priv.y_max); raw++) {
+            xold = (xu < yu ? raw * yu / xu : raw) * (int) scale;
+            yold = (xu > yu ? raw * xu / yu : raw) * (int) scale;
+            xnew = (int) ((transform[0][0] * raw + transform[0][2]) >> 16);
+            ynew = (int) ((transform[1][1] * raw + transform[1][2]) >> 16);
+            if (xnew - xold < 0 || xnew - xold > (xu < yu ? scale : 0) ||
+                ynew - yold < 0 || ynew - yold > (xu > yu ? scale : 0))
+                mismatches++;
         }
+        if (mismatches)
+            IOLog("ALPS: transform differs from the divide path at %d coordinates\n", mismatches);
     }
-    
-#ifdef DEBUG
-    int tm2 = touchmode;
 #endif
-    int dx = 0, dy = 0;
-    
-    switch (touchmode) {
-        case MODE_DRAG:
-        case MODE_DRAGLOCK:
-            if (MODE_DRAGLOCK == touchmode || (!immediateclick || now_ns - touchtime > maxdbltaptime)) {
-                buttons |= 0x1;
-            }
-            // fall through
-        case MODE_MOVE:
-            if (last_fingers == fingers && z<=zlimit)
-            {
-                if (now_ns - touchtime > 100000000) {
-                    if(wasScroll) {
-                        wasScroll = false;
-                        ignoredeltas = ignoredeltasstart;
-                        break;
-                    }
-                    dx = x-lastx+xrest;
-                    dy = lasty-y+yrest;
-                    xrest = dx % divisorx;
-                    yrest = dy % divisory;
-                    if (abs(dx) > bogusdxthresh || abs(dy) > bogusdythresh)
-                        dx = dy = xrest = yrest = 0;
-                }
-            }
-            break;
-            
-        case MODE_MTOUCH:
-            switch (fingers) {
-                case 1:
-                    if (last_fingers != fingers) break;
-                    
-                    // transition from multitouch to single touch
-                    // user could be letting go - ignore single for a few
-                    // packets to see if they completely let go before
-                    // starting to move w/ single finger
-                    if (!wsticky && !scrolldebounce && !ignoresingle)
-                    {
-                        cancelTimer(scrollDebounceTIMER);
-                        setTimerTimeout(scrollDebounceTIMER, scrollexitdelay);
-                        scrolldebounce = true;
-                        wasScroll = true;
-                        dy_history.reset();
-                        time_history.reset();
-                        touchmode=MODE_MOVE;
-                        break;
-                    }
-                    
-                    // Decrement ignore single counter
-                    if (ignoresingle)
-                        ignoresingle--;
-                    
-                    break;
-                case 2: // two finger
-                    if (last_fingers != fingers) {
-                        break;
-                    }
-                    if (palm && z > zlimit) {
-                        break;
-                    }
-                    if (palm_wt && now_ns - keytime < maxaftertyping) {
-                        break;
-                    }
-                    dy = (wvdivisor) ? (y-lasty+yrest) : 0;
-                    dx = (whdivisor&&hscroll) ? (x-lastx+xrest) : 0;
-                    yrest = (wvdivisor) ? dy % wvdivisor : 0;
-                    xrest = (whdivisor&&hscroll) ? dx % whdivisor : 0;
-                    // check for stopping or changing direction
-                    DEBUG_LOG("fingers dy: %d", dy);
-                    if ((dy < 0) != (dy_history.newest() < 0) || dy == 0) {
-                        // stopped or changed direction, clear history
-                        dy_history.reset();
-                        time_history.reset();
-                    }
-                    // put movement and time in history for later
-                    dy_history.filter(dy);
-                    time_history.filter(now_ns);
-                    //REVIEW: filter out small movements (Mavericks issue)
-                    if (abs(dx) < scrolldxthresh)
-                    {
-                        xrest = dx;
-                        dx = 0;
-                    }
-                    if (abs(dy) < scrolldythresh)
-                    {
-                        yrest = dy;
-                        dy = 0;
-                    }
-                    if (0 != dy || 0 != dx)
-                    {
-                        // Don't move unless user is moved fingers far enough to know this wasn't a two finger tap
-                        // Gets rid of scrolling while trying to tap 
-                        if (!touchtime)
-                            dispatchScrollWheelEventX(wvdivisor ? dy / wvdivisor : 0, (whdivisor && hscroll) ? -dx / whdivisor : 0, 0, now_abs);
-                        dx = dy = 0;
-                        ignoresingle = 3;
-                    }
-                    break;
-                    
-                case 3: // three finger
-                    if (last_fingers != fingers) {
-                        break;
-                    }
-                    
-                    if (threefingerhorizswipe || threefingervertswipe) {
-                        // Now calculate total movement since 3 fingers down (add to total)
-                        xmoved += lastx-x;
-                        ymoved += y-lasty;
-                        
-                        // dispatching 3 finger movement
-                        if (ymoved > swipedy && !inSwipeUp && !inSwipe4Up && threefingervertswipe) {
-                            inSwipeUp = 1;
-                            inSwipeDown = 0;
-                            ymoved = 0;
-                            _device->dispatchKeyboardMessage(kPS2M_swipeUp, &now_abs);
-                            break;
-                        }
-                        if (ymoved < -swipedy && !inSwipeDown && !inSwipe4Down && threefingervertswipe) {
-                            inSwipeDown = 1;
-                            inSwipeUp = 0;
-                            ymoved = 0;
-                            _device->dispatchKeyboardMessage(kPS2M_swipeDown, &now_abs);
-                            break;
-                        }
-                        if (xmoved < -swipedx && !inSwipeRight && !inSwipe4Right && threefingerhorizswipe) {
-                            inSwipeRight = 1;
-                            inSwipeLeft = 0;
-                            xmoved = 0;
-                            _device->dispatchKeyboardMessage(kPS2M_swipeRight, &now_abs);
-                            break;
-                        }
-                        if (xmoved > swipedx && !inSwipeLeft && !inSwipe4Left && threefingerhorizswipe) {
-                            inSwipeLeft = 1;
-                            inSwipeRight = 0;
-                            xmoved = 0;
-                            _device->dispatchKeyboardMessage(kPS2M_swipeLeft, &now_abs);
-                            break;
-                        }
-                    }
-                    break;
-                    
-                case 4: // four fingers
-                    if (last_fingers != fingers) {
-                        break;
-                    }
-                    
-                    // Now calculate total movement since 4 fingers down (add to total)
-                    xmoved += lastx-x;
-                    ymoved += y-lasty;
-                    
-                    // dispatching 4 finger movement
-                    if (ymoved > swipedy && !inSwipe4Up) {
-                        inSwipe4Up = 1; inSwipeUp = 0;
-                        inSwipe4Down = 0;
-                        ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Up, &now_abs);
-                        break;
-                    }
-                    if (ymoved < -swipedy && !inSwipe4Down) {
-                        inSwipe4Down = 1; inSwipeDown = 0;
-                        inSwipe4Up = 0;
-                        ymoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Down, &now_abs);
-                        break;
-                    }
-                    if (xmoved < -swipedx && !inSwipe4Right) {
-                        inSwipe4Right = 1; inSwipeRight = 0;
-                        inSwipe4Left = 0;
-                        xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Right, &now_abs);
-                        break;
-                    }
-                    if (xmoved > swipedx && !inSwipe4Left) {
-                        inSwipe4Left = 1; inSwipeLeft = 0;
-                        inSwipe4Right = 0;
-                        xmoved = 0;
-                        _device->dispatchKeyboardMessage(kPS2M_swipe4Left, &now_abs);
-                        break;
-                    }
-            }
-            break;
-        case MODE_DRAGNOTOUCH:
-            buttons |= 0x1;
-            // fall through
-        case MODE_PREDRAG:
-            if (!immediateclick && (!palm_wt || now_ns - keytime >= maxaftertyping)) {
-                buttons |= 0x1;
-            }
-        case MODE_NOTOUCH:
-            break;
-            
-        default:
-            ; // nothing
-    }
-    
-    // capture time of tap, and watch for double/triple tap
-    if (isFingerTouch(z)) {
-        // taps don't count if too close to typing or if currently in momentum scroll
-        if ((!palm_wt || now_ns - keytime >= maxaftertyping) && !momentumscrollcurrent) {
-            
-            if (!isTouchMode()) {
-                touchtime = now_ns;
-            }
-            
-            if (last_fingers < fingers) {
-                touchx = x;
-                touchy = y;
-            }
-            
-            DEBUG_LOG("PS2:Checking Fingers");
-            wasdouble = fingers == 2 || (wasdouble && last_fingers != fingers);// && !scrolldebounce;
-            wastriple = fingers == 3 || (wastriple && last_fingers != fingers);// && !scrolldebounce;
-        }
-        
-        if(!scrolldebounce && momentumscrollcurrent){
-            // any touch cancels momentum scroll
-            momentumscrollcurrent = 0;
-            setTimerTimeout(scrollDebounceTIMER,scrollexitdelay);
-            scrolldebounce = true;
-        }
-    }
-    // switch modes, depending on input
-    if (touchmode == MODE_PREDRAG && isFingerTouch(z)) {
-        touchmode = MODE_DRAG;
-        draglocktemp = _modifierdown & draglocktempmask;
-    }
-    if (touchmode == MODE_DRAGNOTOUCH && isFingerTouch(z)) {
-        if (dragTimer)
-            cancelTimer(dragTimer);
-        touchmode=MODE_DRAGLOCK;
-    }
-    if (MODE_MTOUCH != touchmode && fingers > 1 && isFingerTouch(z)) {
-        touchmode = MODE_MTOUCH;
-    }
-    
-    if (touchmode == MODE_NOTOUCH && z > z_finger && !scrolldebounce) {
-        touchmode = MODE_MOVE;
+}
+
+void ALPS::dispatchEventsWithInfo(int xraw, int yraw, int z, int fingers, UInt32 buttonsraw) {
+    GestureFrame frame;
+    
+    // time the packet arrived, not when the work loop got to it
+    frame.now_abs = _packetTime;
+    if (!frame.now_abs)
+        frame.now_abs = getClock()->uptime();
+    frame.now_ns = getClock()->toNanoseconds(frame.now_abs);
+    
+    // normalize, aspect correct and orient (see alps_update_transform)
+    frame.x = (int) ((transform[0][0] * xraw + transform[0][1] * yraw + transform[0][2]) >> 16);
+    frame.y = (int) ((transform[1][0] * xraw + transform[1][1] * yraw + transform[1][2]) >> 16);
+    frame.z = z;
+    frame.fingers = fingers;
+    frame.buttons = buttonsraw;
+    frame.primarychanged = priv.primary_changed;
+    
+    // all tracked contacts (V7 and SS4), through the same transform
+    frame.ncontacts = min(priv.num_contacts, kMaxContacts);
+    for (int i = 0; i < frame.ncontacts; i++) {
+        int cx = priv.contacts[i].x, cy = priv.contacts[i].y;
+        frame.contactx[i] = (int) ((transform[0][0] * cx + transform[0][1] * cy + transform[0][2]) >> 16);
+        frame.contacty[i] = (int) ((transform[1][0] * cx + transform[1][1] * cy + transform[1][2]) >> 16);
+    }
+    frame.contactschanged = priv.contacts_changed;
+    
+    if (!recognizeGesture(frame)) {
+        return;
     }
     
     // dispatch dx/dy and current button status
-    dispatchRelativePointerEventX(dx / divisorx, dy / divisory, buttons, now_abs);
-    
-    // always save last seen position for calculating deltas later
-    lastx = x;
-    lasty = y;
-    //b4last = last_fingers;
-    last_fingers = fingers;
-    
-#ifdef DEBUG
-    DEBUG_LOG("ps2: fingers=%d, dx=%d, dy=%d (%d,%d) z=%d mode=(%d,%d,%d) buttons=%d wasdouble=%d wastriple=%d\n", fingers, dx, dy, x, y, z, tm1, tm2, touchmode, buttons, wasdouble, wastriple);
-#endif
+    dispatchRelativePointerEventX(frame.dx, frame.dy, frame.buttons, frame.now_abs);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -3238,7 +3641,120 @@ dispatchRelativePointerEventWithPacket(UInt8 *packet,
     }
     
     uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    now_abs = getClock()->uptime();
     IOLog("ALPS: Dispatch relative PS2 packet: dx=%d, dy=%d, buttons=%d\n", dx, dy, buttons);
     dispatchRelativePointerEventX(dx, dy, buttons, now_abs);
 }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ALPS::setParamPropertiesGated(OSDictionary *config) {
+    super::setParamPropertiesGated(config);
+    
+    if (NULL == config)
+        return;
+    
+    const struct {const char *name; int *var;} int32vars[]={
+        {"IdleReportRate",                  &idlereportrate},
+        {"ReportRate",                      &reportrate},
+        {"TrackstickAccelMax",              &trackstickaccelmax},
+        {"TrackstickAccelPressure",         &trackstickaccelpressure},
+        {"TrackstickAccelSpeed",            &trackstickaccelspeed},
+        {"TrackstickPressureThreshold",     &trackstickpressurethresh},
+        {"TrackstickScrollDivisor",         &trackstickscrolldivisor},
+    };
+    const struct {const char *name; int *var;} boolvars[]={
+        {"FlipX",                           &flipx},
+        {"FlipY",                           &flipy},
+        {"SwapXY",                          &swapxy},
+    };
+    const struct {const char *name; uint64_t *var;} int64vars[]={
+        {"IdleTimeout",                     &idletimeout},
+    };
+    
+    OSNumber *num;
+    for (int i = 0; i < countof(int32vars); i++) {
+        if ((num = OSDynamicCast(OSNumber, config->getObject(int32vars[i].name)))) {
+            *int32vars[i].var = num->unsigned32BitValue();
+            setProperty(int32vars[i].name, *int32vars[i].var, 32);
+        }
+    }
+    for (int i = 0; i < countof(int64vars); i++) {
+        if ((num = OSDynamicCast(OSNumber, config->getObject(int64vars[i].name)))) {
+            *int64vars[i].var = num->unsigned64BitValue();
+            setProperty(int64vars[i].name, *int64vars[i].var, 64);
+        }
+    }
+    OSBoolean *bl;
+    for (int i = 0; i < countof(boolvars); i++) {
+        if ((bl = OSDynamicCast(OSBoolean, config->getObject(boolvars[i].name)))) {
+            *boolvars[i].var = bl->isTrue();
+            setProperty(boolvars[i].name, *boolvars[i].var ? kOSBooleanTrue : kOSBooleanFalse);
+        }
+    }
+    
+    // UnitsPerMMX/Y may have changed
+    alps_update_transform();
+    
+    // identity of this machine's touchpad: E7 report followed by EC report
+    OSData *identity = OSDynamicCast(OSData, config->getObject("ALPSIdentity"));
+    if (identity && identity->getLength() == sizeof(priv.id_e7) + sizeof(priv.id_ec)) {
+        const UInt8 *bytes = (const UInt8 *) identity->getBytesNoCopy();
+        memcpy(priv.id_e7, bytes, sizeof(priv.id_e7));
+        memcpy(priv.id_ec, bytes + sizeof(priv.id_e7), sizeof(priv.id_ec));
+        priv.id_cached = true;
+    }
+    
+#ifdef DEBUG
+    alps_inject_packets(OSDynamicCast(OSData, config->getObject("InjectPackets")));
+#endif
+}
+
+#ifdef DEBUG
+/*
+ * Debug builds only: run raw bytes from user space (the "InjectPackets"
+ * property, as recorded from the device) through the same framing and
+ * decode path as bytes from the hardware, on a PS2ReplayClock that steps
+ * one report interval per packet. This lets recorded packet streams be
+ * replayed on a machine with an ALPS pad attached; there is no
+ * packet encoder or virtual touchpad in the driver. The framing state is
+ * shared with the interrupt handler, so the device stream is stopped while
+ * injecting and restarted afterwards unless the touchpad was toggled off.
+ */
+void ALPS::alps_inject_packets(OSData *data) {
+    const UInt8 *bytes;
+    unsigned int i, length;
+    
+    if (!data || !_interruptHandlerInstalled)
+        return;
+    
+    bytes = (const UInt8 *) data->getBytesNoCopy();
+    length = data->getLength();
+    
+    DEBUG_LOG("ALPS: injecting %u bytes\n", length);
+    
+    // the device must not be a second producer on the ring buffer
+    if (!streamoff)
+        ps2_command_short(kDP_SetDefaultsAndDisable);
+    packetReady();
+    
+    // packets are seen one report interval apart, as from the device
+    PS2ReplayClock replay(getClock()->uptime());
+    setClock(&replay);
+    
+    _packetByteCount = 0;
+    for (i = 0; i < length; i++) {
+        if (interruptOccurred(bytes[i]) == kPS2IR_packetReady) {
+            packetReady();
+            replay.advance(1000000000ULL / (reportrate ? reportrate : ALPS_DEFAULT_RATE));
+        }
+    }
+    _packetByteCount = 0;
+    
+    setClock(NULL);
+    alps_note_activity(getClock()->uptime());
+    
+    if (!streamoff)
+        ps2_command_short(kDP_Enable);
+}
+#endif
@@ -34,6 +34,19 @@
 
 #define MAX_TOUCHES     4
 
+/* Largest packet of any protocol (V4) */
+#define ALPS_MAX_PACKET_SIZE    8
+
+/* Room for the command stream of a recorded hw_init */
+#define ALPS_INIT_PROGRAM_SIZE  512
+#define ALPS_INIT_REQUESTS      256
+
+/* 2 * start_bit + num_bits - 1 of a bitmap contact is always below this */
+#define ALPS_BITMAP_COORDS  64
+
+/* PS/2 default report rate, what F5 leaves the device at */
+#define ALPS_DEFAULT_RATE   100
+
 #define DOLPHIN_COUNT_PER_ELECTRODE	64
 #define DOLPHIN_PROFILE_XOFFSET		8	/* x-electrode offset */
 #define DOLPHIN_PROFILE_YOFFSET		1	/* y-electrode offset */
@@ -222,20 +235,64 @@ struct alps_fields {
     UInt32 ts_middle:1;
 };
 
+/**
+ * struct alps_byte_check - framing rule for one byte of a packet
+ * @mask: Bits of the byte that must equal value.
+ * @value: Expected value of the bits in mask.
+ * @reject_mask: Bits of the byte that must not equal reject_value.
+ * @reject_value: Rejected value of the bits in reject_mask; a value with
+ *   bits outside reject_mask disables the check.
+ */
+struct alps_byte_check {
+    UInt8 mask;
+    UInt8 value;
+    UInt8 reject_mask;
+    UInt8 reject_value;
+};
+
+/**
+ * struct alps_contact - a contact followed from packet to packet
+ * @id: Tracking id, kept until the finger is lifted.
+ * @x: Last X position.
+ * @y: Last Y position.
+ * @dx: Smoothed X movement per packet, used to predict the next position.
+ * @dy: Smoothed Y movement per packet, used to predict the next position.
+ */
+struct alps_contact {
+    int id;
+    int x;
+    int y;
+    int dx;
+    int dy;
+};
+
+/**
+ * struct alps_packet_stats - framing counters for the current logging window
+ * @resyncs: Times framing was lost and recovered.
+ * @dropped_bytes: Bytes discarded while resynchronizing or as bare PS/2.
+ * @window_start: Start of the current window, in absolute time units.
+ */
+struct alps_packet_stats {
+    UInt32 resyncs;
+    UInt32 dropped_bytes;
+    uint64_t window_start;
+};
+
 class ALPS;
 
 /**
  * struct alps_data - private data structure for the ALPS driver
- * @nibble_commands: Command mapping used for touchpad register accesses.
- * @addr_command: Command used to tell the touchpad that a register address
- *   follows.
- * @proto_version: Indicates V1/V2/V3/...
  * @byte0: Helps figure out whether a position report packet matches the
  *   known format for this model.  The first byte of the report, ANDed with
  *   mask0, should match byte0.
  * @mask0: The mask used to check the first byte of the report.
- * @fw_ver: cached copy of firmware version (EC report)
+ * @pktsize: Bytes in a packet of this protocol.
+ * @byte_check: Framing rule for each byte of a packet.
+ * @bare_mask: Mask for spotting a bare PS/2 first byte, 0 when the
+ *   protocol's first byte can not be told apart from one (V8).
+ * @proto_version: Indicates V1/V2/V3/...
  * @flags: Additional device capabilities (passthrough port, trackstick, etc.).
+ * @quirks: Bitmap of ALPS_QUIRK_*.
  * @x_max: Largest possible X position value.
  * @y_max: Largest possible Y position value.
  * @x_bits: Number of X bits in the MT bitmap.
@@ -244,32 +301,83 @@ class ALPS;
  * @multi_packet: Multi-packet data in progress.
  * @multi_data: Saved multi-packet data.
  * @f: Decoded packet data fields.
- * @quirks: Bitmap of ALPS_QUIRK_*.
+ * @contacts: Tracked contacts, oldest first (V7 and SS4).
+ * @num_contacts: Number of entries in contacts.
+ * @next_contact_id: Id handed to the next new contact.
+ * @primary_changed: The oldest contact changed with the last packet.
+ * @contacts_changed: A contact went down or up with the last packet.
+ * @stats: Framing counters.
+ * @x_bitmap_coord: X coordinate of a bitmap contact by half-electrode index.
+ * @y_bitmap_coord: Y coordinate of a bitmap contact by half-electrode index.
+ * @nibble_commands: Command mapping used for touchpad register accesses.
+ * @addr_command: Command used to tell the touchpad that a register address
+ *   follows.
+ * @fw_ver: cached copy of firmware version (EC report)
+ * @cur_addr: Register address currently set in command mode, or -1.
+ * @init_program: Commands of the last successful hw_init, for replay on wake.
+ * @init_sizes: Number of commands in each request of init_program.
+ * @init_length: Number of commands in init_program.
+ * @init_count: Number of requests in init_program, 0 if there is none.
+ * @init_recording: hw_init requests are being recorded.
+ * @init_time: Time the recorded hw_init took, in absolute time units.
+ * @id_e7: E7 report from the ALPSIdentity setting.
+ * @id_ec: EC report from the ALPSIdentity setting.
+ * @id_cached: id_e7 and id_ec are set.
  */
 struct alps_data {
-    /* these are autodetected when the device is identified */
-    const struct alps_nibble_commands *nibble_commands;
-    SInt32 addr_command;
-    UInt16 proto_version;
+    /*
+     * Read or written for every packet: framing, decoding and contact
+     * tracking come first, so a packet touches as few cache lines as
+     * possible.  Most of it is autodetected when the device is identified.
+     */
     UInt8 byte0, mask0;
-    UInt8 fw_ver[3];
+    int pktsize = 6;
+    struct alps_byte_check byte_check[ALPS_MAX_PACKET_SIZE];
+    UInt8 bare_mask;
+    UInt16 proto_version;
     int flags;
+    UInt8 quirks;
     SInt32 x_max;
     SInt32 y_max;
     SInt32 x_bits;
     SInt32 y_bits;
-    unsigned int x_res;
-    unsigned int y_res;
     
     SInt32 prev_fin;
     SInt32 multi_packet;
     int second_touch;
     UInt8 multi_data[6];
     struct alps_fields f;
-    UInt8 quirks;
-    bool PSMOUSE_BAD_DATA;
     
-    int pktsize = 6;
+    struct alps_contact contacts[MAX_TOUCHES];
+    int num_contacts;
+    int next_contact_id;
+    bool primary_changed;
+    bool contacts_changed;
+    
+    struct alps_packet_stats stats;
+    
+    UInt32 x_bitmap_coord[ALPS_BITMAP_COORDS];
+    UInt32 y_bitmap_coord[ALPS_BITMAP_COORDS];
+    
+    /* only used while the device is identified and set up */
+    const struct alps_nibble_commands *nibble_commands;
+    SInt32 addr_command;
+    UInt8 fw_ver[3];
+    unsigned int x_res;
+    unsigned int y_res;
+    
+    int cur_addr;
+    
+    PS2Command init_program[ALPS_INIT_PROGRAM_SIZE];
+    UInt8 init_sizes[ALPS_INIT_REQUESTS];
+    int init_length;
+    int init_count;
+    bool init_recording;
+    uint64_t init_time;
+    
+    UInt8 id_e7[3];
+    UInt8 id_ec[3];
+    bool id_cached;
 };
 
 // Pulled out of alps_data, now saved as vars on class
@@ -305,7 +413,6 @@ class EXPORT ALPS : public VoodooPS2TouchPadBase {
 private:
     alps_data priv;
     hw_init hw_init;
-    decode_fields decode_fields;
     process_packet process_packet;
     //    set_abs_params set_abs_params;
     
@@ -314,6 +421,8 @@ public:
     
     bool init(OSDictionary * dict);
     
+    bool start(IOService *provider);
+    
     void stop(IOService *provider);
     
 protected:
@@ -321,16 +430,66 @@ protected:
     
     UInt8 _multiData[6];
     
+    // report rate and idle downshift
+    int reportrate;
+    int idlereportrate;
+    uint64_t idletimeout;
+    uint64_t lastactivity;
+    bool idlerate;
+    bool idletimerarmed;
+    IOTimerEventSource *idleTimer;
+    
+    // touchpad stream stopped at the device while disabled, and attempts
+    // left to get the device into the wanted state
+    bool streamoff;
+    int streamretries;
+    
+    // trackstick acceleration and scroll (gains in 1/256 units)
+    int trackstickaccelspeed;
+    int trackstickaccelpressure;
+    int trackstickpressurethresh;
+    int trackstickaccelmax;
+    int trackstickscrolldivisor;
+    int trackstickrestx;
+    int trackstickresty;
+    bool trackstickscrolling;
+    
+    // raw position to 6000 units (Q16 affine, rows x and y)
+    SInt64 transform[2][3];
+    int swapxy, flipx, flipy;
+    
     IOGBounds _bounds;
     
     virtual bool deviceSpecificInit();
     
     bool resetMouse();
     
+    void alps_submit(PS2Request *request);
+    
+    bool alps_replay_init();
+    
+    bool alps_set_report_rate(int rate);
+    
+    void alps_set_report_rate_async(int rate);
+    
+    void alps_set_report_rate_done(void *param);
+    
+    void alps_note_activity(uint64_t now_abs);
+    
+    void onIdleTimer();
+    
+    virtual void touchpadToggled();
+    
+    void alps_set_stream_async(bool off);
+    
+    void alps_set_stream_done(void *param);
+    
     void alps_process_packet_v1_v2(UInt8 *packet);
     
     int alps_process_bitmap(struct alps_data *priv, struct alps_fields *f);
     
+    void alps_process_trackstick(int x, int y, int z, int divisor, UInt32 buttons, uint64_t now_abs);
+    
     void alps_process_trackstick_packet_v3(UInt8 * packet);
     
     bool alps_decode_buttons_v3(struct alps_fields *f, UInt8 *p);
@@ -341,8 +500,10 @@ protected:
     
     bool alps_decode_dolphin(struct alps_fields *f, UInt8 *p);
     
-    void alps_process_touchpad_packet_v3_v5(UInt8 * packet);
+    template <decode_fields decode>
+    void alps_process_touchpad_packet_v3_v5(UInt8 *packet);
     
+    template <decode_fields decode>
     void alps_process_packet_v3(UInt8 *packet);
     
     void alps_process_packet_v6(UInt8 *packet);
@@ -355,6 +516,8 @@ protected:
     
     int alps_get_mt_count(struct input_mt_pos *mt);
     
+    void alps_track_contacts(struct alps_fields *f);
+    
     bool alps_decode_packet_v7(struct alps_fields *f, UInt8 *p);
     
     void alps_process_trackstick_packet_v7(UInt8 *packet);
@@ -375,10 +538,30 @@ protected:
     
     void setTouchPadEnable(bool enable);
     
+    virtual void setParamPropertiesGated(OSDictionary *config);
+    
+#ifdef DEBUG
+    void alps_inject_packets(OSData *data);
+#endif
+    
+    void alps_set_byte_checks();
+    
+    inline bool alps_is_valid_byte(UInt8 *packet, int index);
+    
+    void alps_resync(UInt8 *packet);
+    
     PS2InterruptResult interruptOccurred(UInt8 data);
     
     void packetReady();
     
+#ifdef DEBUG
+    void alps_update_stats(uint64_t now_abs);
+#endif
+    
+    int alps_command_mode_add_nibble(PS2Command *commands, int cmdCount, int nibble);
+    
+    int alps_command_mode_add_addr(PS2Command *commands, int cmdCount, int addr);
+    
     bool alps_command_mode_send_nibble(int value);
     
     bool alps_command_mode_set_addr(int addr);
@@ -389,8 +572,14 @@ protected:
     
     bool alps_command_mode_write_reg(UInt8 value);
     
+    int alps_add_rpt_cmd(PS2Command *commands, int cmd, SInt32 init_command, SInt32 init_arg, SInt32 repeated_command);
+    
     bool alps_rpt_cmd(SInt32 init_command, SInt32 init_arg, SInt32 repeated_command, ALPSStatus_t *report);
     
+    bool alps_read_identity(ALPSStatus_t *e6, ALPSStatus_t *e7, ALPSStatus_t *ec);
+    
+    bool alps_confirm_identity(ALPSStatus_t *e7, ALPSStatus_t *ec);
+    
     bool alps_enter_command_mode();
     
     bool alps_exit_command_mode();
@@ -449,6 +638,10 @@ protected:
     
     void ps2_command(unsigned char value, UInt8 command);
         
+    void alps_set_bitmap_tables();
+    
+    void alps_update_transform();
+    
     void set_protocol();
     
     bool matchTable(ALPSStatus_t *e7, ALPSStatus_t *ec);